@@ -0,0 +1,129 @@
+// AllocBenchmark measures fb_allocator throughput with 1, 2, 4 and 8 threads
+// allocating and freeing blocks. Each thread count is run twice: once with
+// every thread sharing one allocator, then with each thread using its own
+// allocator. Build with ALLOC_LOCK_FREE, ALLOC_THREAD_CACHE or LK_SPIN_LOCK
+// defined to compare the allocator configurations. Thread caches are 
+// returned as each worker thread exits.
+//
+// AllocBenchmark [iterations per thread]
+
+#include "fb_allocator.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+// Blocks held by a thread between frees
+#define BENCH_BATCH         8
+#define BENCH_MAX_THREADS   8
+#define BENCH_BLOCK_SIZE    32
+
+// Blocks per thread, leaving room for a thread cache magazine
+#define BENCH_THREAD_BLOCKS (BENCH_BATCH * 2)
+
+ALLOC_DEFINE(sharedAllocator, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS * BENCH_MAX_THREADS)
+ALLOC_DEFINE(threadAllocator0, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator1, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator2, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator3, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator4, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator5, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator6, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+ALLOC_DEFINE(threadAllocator7, BENCH_BLOCK_SIZE, BENCH_THREAD_BLOCKS)
+
+static const ALLOC_HANDLE _threadAllocators[BENCH_MAX_THREADS] =
+{
+    threadAllocator0, threadAllocator1, threadAllocator2, threadAllocator3,
+    threadAllocator4, threadAllocator5, threadAllocator6, threadAllocator7
+};
+
+//------------------------------------------------------------------------------
+// BENCH_Worker
+//------------------------------------------------------------------------------
+static void BENCH_Worker(ALLOC_HANDLE hAlloc, UINT32 iterations)
+{
+    void* blocks[BENCH_BATCH];
+    UINT32 i, j;
+
+    // Each iteration allocates and frees BENCH_BATCH blocks
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < BENCH_BATCH; j++)
+        {
+            blocks[j] = ALLOC_Alloc(hAlloc, BENCH_BLOCK_SIZE);
+            *(volatile BYTE*)blocks[j] = (BYTE)j;
+        }
+        for (j = 0; j < BENCH_BATCH; j++)
+            ALLOC_Free(hAlloc, blocks[j]);
+    }
+}
+
+//------------------------------------------------------------------------------
+// BENCH_Run
+//------------------------------------------------------------------------------
+static double BENCH_Run(UINT32 threads, bool shared, UINT32 iterations)
+{
+    std::vector<std::thread> workers;
+    UINT32 t;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (t = 0; t < threads; t++)
+    {
+        ALLOC_HANDLE hAlloc = shared ? sharedAllocator : _threadAllocators[t];
+        workers.emplace_back(BENCH_Worker, hAlloc, iterations);
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // One operation is an alloc/free pair
+    return (double)threads * iterations * BENCH_BATCH / elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+    UINT32 iterations = 200000;
+    UINT32 threads;
+    ALLOC_Stats stats[BENCH_MAX_THREADS + 1];
+    UINT16 count, i;
+    int result = 0;
+
+    if (argc > 1)
+        iterations = (UINT32)strtoul(argv[1], NULL, 10);
+
+    ALLOC_Init();
+
+    printf("fb_allocator %u byte blocks, %u iterations of %u alloc/free pairs per thread\n",
+        BENCH_BLOCK_SIZE, iterations, BENCH_BATCH);
+    printf("%-8s %18s %18s\n", "threads", "shared ops/sec", "per-thread ops/sec");
+
+    for (threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2)
+    {
+        double sharedOps = BENCH_Run(threads, true, iterations);
+        double perThreadOps = BENCH_Run(threads, false, iterations);
+        printf("%-8u %18.0f %18.0f\n", threads, sharedOps, perThreadOps);
+    }
+
+    // Every block must be back in its allocator, including the blocks 
+    // cached by the exited worker threads
+    count = ALLOC_GetStats(stats, BENCH_MAX_THREADS + 1);
+    for (i = 0; i < count; i++)
+    {
+        if (stats[i].blocksInUse != 0 || stats[i].blocksCached != 0)
+        {
+            printf("%s: %llu blocks in use, %llu cached\n", stats[i].name,
+                (unsigned long long)stats[i].blocksInUse, (unsigned long long)stats[i].blocksCached);
+            result = 1;
+        }
+    }
+
+    ALLOC_Term();
+
+    return result;
+}
@@ -0,0 +1,170 @@
+// The Atomic module provides the small set of atomic operations needed by
+// the lock-free allocator, spin lock and state machine code. Each function 
+// is a thin inline wrapper around the compiler intrinsics. All operations are
+// sequentially consistent unless the name states otherwise.
+
+#ifndef _ATOMIC_H
+#define _ATOMIC_H
+
+#include "DataTypes.h"
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Atomically add value to *p. Returns the new value.
+static __inline UINT16 ATOMIC_Add16(volatile UINT16* p, INT16 value)
+{
+#if defined(_MSC_VER)
+    return (UINT16)(_InterlockedExchangeAdd16((volatile short*)p, value) + value);
+#else
+    return __atomic_add_fetch(p, (UINT16)value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// If *p equals expected, store desired. Returns TRUE if the store occurred.
+static __inline BOOL ATOMIC_Cas16(volatile UINT16* p, UINT16 expected, UINT16 desired)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange16((volatile short*)p, (short)desired, (short)expected) == (short)expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically load *p
+static __inline UINT16 ATOMIC_Load16(volatile UINT16* p)
+{
+#if defined(_MSC_VER)
+    return (UINT16)_InterlockedCompareExchange16((volatile short*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically load *p
+static __inline UINT32 ATOMIC_Load32(volatile UINT32* p)
+{
+#if defined(_MSC_VER)
+    return (UINT32)_InterlockedCompareExchange((volatile long*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically add value to *p. Returns the previous value.
+static __inline UINT32 ATOMIC_FetchAdd32(volatile UINT32* p, UINT32 value)
+{
+#if defined(_MSC_VER)
+    return (UINT32)_InterlockedExchangeAdd((volatile long*)p, (long)value);
+#else
+    return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically store value to *p. Returns the previous value.
+static __inline UINT32 ATOMIC_Exchange32(volatile UINT32* p, UINT32 value)
+{
+#if defined(_MSC_VER)
+    return (UINT32)_InterlockedExchange((volatile long*)p, (long)value);
+#else
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// If *p equals expected, store desired. Returns TRUE if the store occurred.
+static __inline BOOL ATOMIC_Cas32(volatile UINT32* p, UINT32 expected, UINT32 desired)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange((volatile long*)p, (long)desired, (long)expected) == (long)expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically load *p
+static __inline UINT64 ATOMIC_Load64(volatile UINT64* p)
+{
+#if defined(_MSC_VER)
+    return (UINT64)_InterlockedCompareExchange64((volatile __int64*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically add value to *p. Returns the new value.
+static __inline UINT64 ATOMIC_Add64(volatile UINT64* p, UINT64 value)
+{
+#if defined(_MSC_VER)
+    return (UINT64)_InterlockedExchangeAdd64((volatile __int64*)p, (__int64)value) + value;
+#else
+    return __atomic_add_fetch(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically store value to *p without ordering other loads and stores. 
+// Readers never see a torn value. Only for a location with a single writer.
+static __inline void ATOMIC_StoreRelaxed64(volatile UINT64* p, UINT64 value)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    *p = value;
+#elif defined(_MSC_VER)
+    __int64 expected = *(volatile __int64*)p;
+    __int64 previous;
+    while ((previous = _InterlockedCompareExchange64((volatile __int64*)p, (__int64)value, expected)) != expected)
+        expected = previous;
+#else
+    __atomic_store_n(p, value, __ATOMIC_RELAXED);
+#endif
+}
+
+// If *p equals expected, store desired. Returns TRUE if the store occurred.
+static __inline BOOL ATOMIC_Cas64(volatile UINT64* p, UINT64 expected, UINT64 desired)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange64((volatile __int64*)p, (__int64)desired, (__int64)expected) == (__int64)expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Atomically load *p
+static __inline void* ATOMIC_LoadPtr(void* volatile* p)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchangePointer(p, NULL, NULL);
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// If *p equals expected, store desired. Returns TRUE if the store occurred.
+static __inline BOOL ATOMIC_CasPtr(void* volatile* p, void* expected, void* desired)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchangePointer(p, desired, expected) == expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Full memory barrier. Loads and stores are not reordered across the fence.
+static __inline void ATOMIC_Fence(void)
+{
+#if defined(_MSC_VER)
+    long barrier = 0;
+    _InterlockedExchange(&barrier, 0);
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ATOMIC_H
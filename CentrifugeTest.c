@@ -17,9 +17,9 @@ SM_DEFINE(CentrifugeTestSM, &centrifugeTestObj)
 // method entries in the state map
 enum States
 {
-    ST_IDLE,
-    ST_COMPLETED,
-    ST_FAILED,
+    ST_IDLE = CFG_STATE_IDLE,
+    ST_COMPLETED = CFG_STATE_COMPLETED,
+    ST_FAILED = CFG_STATE_FAILED,
     ST_START_TEST,
     ST_ACCELERATION,
     ST_WAIT_FOR_ACCELERATION,
@@ -113,39 +113,39 @@ BOOL CFG_IsPollActive(void)
 
 STATE_DEFINE(Idle, NoEventData)
 {
-    printf("%s ST_Idle\n", self->name);
+    printf("%s ST_Idle\n", SM_GetName());
 }
 
 ENTRY_DEFINE(Idle, NoEventData)
 {
-    printf("%s EN_Idle\n", self->name);
+    printf("%s EN_Idle\n", SM_GetName());
     centrifugeTestObj.speed = 0;
     StopPoll();
 }
 
 STATE_DEFINE(Completed, NoEventData)
 {
-    printf("%s ST_Completed\n", self->name);
+    printf("%s ST_Completed\n", SM_GetName());
     SM_InternalEvent(ST_IDLE, NULL);
 }
 
 STATE_DEFINE(Failed, NoEventData)
 {
-    printf("%s ST_Failed\n", self->name);
+    printf("%s ST_Failed\n", SM_GetName());
     SM_InternalEvent(ST_IDLE, NULL);
 }
 
 // Start the centrifuge test state.
 STATE_DEFINE(StartTest, NoEventData)
 {
-    printf("%s ST_StartTest\n", self->name);
+    printf("%s ST_StartTest\n", SM_GetName());
     SM_InternalEvent(ST_ACCELERATION, NULL);
 }
 
 // Guard condition to determine whether StartTest state is executed.
 GUARD_DEFINE(StartTest, NoEventData)
 {
-    printf("%s GD_StartTest\n", self->name);
+    printf("%s GD_StartTest\n", SM_GetName());
     if (centrifugeTestObj.speed == 0)
         return TRUE;    // Centrifuge stopped. OK to start test.
     else
@@ -155,7 +155,7 @@ GUARD_DEFINE(StartTest, NoEventData)
 // Start accelerating the centrifuge.
 STATE_DEFINE(Acceleration, NoEventData)
 {
-    printf("%s ST_Acceleration\n", self->name);
+    printf("%s ST_Acceleration\n", SM_GetName());
 
     // Start polling while waiting for centrifuge to ramp up to speed
     StartPoll();
@@ -164,7 +164,7 @@ STATE_DEFINE(Acceleration, NoEventData)
 // Wait in this state until target centrifuge speed is reached.
 STATE_DEFINE(WaitForAcceleration, NoEventData)
 {
-    printf("%s ST_WaitForAcceleration : Speed is %d\n", self->name, centrifugeTestObj.speed);
+    printf("%s ST_WaitForAcceleration : Speed is %d\n", SM_GetName(), centrifugeTestObj.speed);
     if (++centrifugeTestObj.speed >= 5)
         SM_InternalEvent(ST_DECELERATION, NULL);
 }
@@ -172,7 +172,7 @@ STATE_DEFINE(WaitForAcceleration, NoEventData)
 // Exit action when WaitForAcceleration state exits.
 EXIT_DEFINE(WaitForAcceleration)
 {
-    printf("%s EX_WaitForAcceleration\n", self->name);
+    printf("%s EX_WaitForAcceleration\n", SM_GetName());
 
     // Acceleration over, stop polling
     StopPoll();
@@ -181,7 +181,7 @@ EXIT_DEFINE(WaitForAcceleration)
 // Start decelerating the centrifuge.
 STATE_DEFINE(Deceleration, NoEventData)
 {
-    printf("%s ST_Deceleration\n", self->name);
+    printf("%s ST_Deceleration\n", SM_GetName());
 
     // Start polling while waiting for centrifuge to ramp down to 0
     StartPoll();
@@ -190,7 +190,7 @@ STATE_DEFINE(Deceleration, NoEventData)
 // Wait in this state until centrifuge speed is 0.
 STATE_DEFINE(WaitForDeceleration, NoEventData)
 {
-    printf("%s ST_WaitForDeceleration : Speed is %d\n", self->name, centrifugeTestObj.speed);
+    printf("%s ST_WaitForDeceleration : Speed is %d\n", SM_GetName(), centrifugeTestObj.speed);
     if (centrifugeTestObj.speed-- == 0)
         SM_InternalEvent(ST_COMPLETED, NULL);
 }
@@ -198,7 +198,7 @@ STATE_DEFINE(WaitForDeceleration, NoEventData)
 // Exit action when WaitForDeceleration state exits.
 EXIT_DEFINE(WaitForDeceleration)
 {
-    printf("%s EX_WaitForDeceleration\n", self->name);
+    printf("%s EX_WaitForDeceleration\n", SM_GetName());
 
     // Deceleration over, stop polling
     StopPoll();
@@ -4,6 +4,10 @@
 #include "DataTypes.h"
 #include "StateMachine.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Declare the private instance of CentrifugeTest state machine
 SM_DECLARE(CentrifugeTestSM)
 
@@ -14,4 +18,11 @@ EVENT_DECLARE(CFG_Poll, NoEventData)
 
 BOOL CFG_IsPollActive();
 
+// States reported to transition observers, e.g. SMCoroutine::until_state()
+enum { CFG_STATE_IDLE = 0, CFG_STATE_COMPLETED = 1, CFG_STATE_FAILED = 2 };
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // _CENTRIFUGE_TEST_H
@@ -1,16 +1,51 @@
 #include "LockGuard.h"
 #include "Fault.h"
 #include <mutex>
+#ifdef LK_LOCK_STATS
+    #include <chrono>
+#endif
+#ifdef LK_SPIN_LOCK
+    #include <thread>
+    #if defined(_WIN32)
+        #include <windows.h>
+        #pragma comment(lib, "Synchronization.lib")
+    #elif defined(__linux__)
+        #include <linux/futex.h>
+        #include <sys/syscall.h>
+        #include <unistd.h>
+    #endif
+    #if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        #include <immintrin.h>
+    #endif
+#endif
 
+#ifdef LK_LOCK_STATS
+//------------------------------------------------------------------------------
+// LK_NowNs
+//------------------------------------------------------------------------------
+static UINT64 LK_NowNs(void)
+{
+    return (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+#ifndef LK_SPIN_LOCK
 // A lock is a mutex
-#define LOCK std::mutex
+struct LOCK
+{
+    std::mutex mutex;
+#ifdef LK_LOCK_STATS
+    LK_Stats stats;
+#endif
+};
 
 //------------------------------------------------------------------------------
 // LK_Create
 //------------------------------------------------------------------------------
 LOCK_HANDLE LK_Create(void)
 {
-    LOCK* lock = new LOCK;
+    LOCK* lock = new LOCK();
     return lock;
 }
 
@@ -31,7 +66,19 @@ void LK_Lock(LOCK_HANDLE hLock)
 {
     ASSERT_TRUE(hLock);
     LOCK* lock = (LOCK*)(hLock);
-	lock->lock();
+#ifdef LK_LOCK_STATS
+    // Only time the acquisitions that must wait
+    if (!lock->mutex.try_lock())
+    {
+        UINT64 start = LK_NowNs();
+        lock->mutex.lock();
+        lock->stats.contended++;
+        lock->stats.waitNs += LK_NowNs() - start;
+    }
+    lock->stats.acquisitions++;
+#else
+	lock->mutex.lock();
+#endif
 }
 
 //------------------------------------------------------------------------------
@@ -41,6 +88,209 @@ void LK_Unlock(LOCK_HANDLE hLock)
 {
     ASSERT_TRUE(hLock);
     LOCK* lock = (LOCK*)(hLock);
-    lock->unlock();
+    lock->mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+// LK_TryLock
+//------------------------------------------------------------------------------
+BOOL LK_TryLock(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    LOCK* lock = (LOCK*)(hLock);
+    if (!lock->mutex.try_lock())
+        return FALSE;
+#ifdef LK_LOCK_STATS
+    lock->stats.acquisitions++;
+#endif
+    return TRUE;
+}
+
+#ifdef LK_LOCK_STATS
+//------------------------------------------------------------------------------
+// LK_GetStats
+//------------------------------------------------------------------------------
+void LK_GetStats(LOCK_HANDLE hLock, LK_Stats* pStats)
+{
+    ASSERT_TRUE(hLock);
+    ASSERT_TRUE(pStats);
+    LOCK* lock = (LOCK*)(hLock);
+
+    // Copy under the lock without counting this acquisition
+    lock->mutex.lock();
+    *pStats = lock->stats;
+    lock->mutex.unlock();
+}
+#endif
+
+#else
+// Contended acquisitions spin up to LK_MAX_SPINS iterations before parking
+#define LK_MAX_SPINS    256
+#define LK_MIN_SPINS    16
+
+//------------------------------------------------------------------------------
+// LK_CpuRelax
+//------------------------------------------------------------------------------
+static inline void LK_CpuRelax(void)
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+//------------------------------------------------------------------------------
+// LK_Park
+//------------------------------------------------------------------------------
+static void LK_Park(volatile UINT32* pState, UINT32 value)
+{
+    // Sleep while *pState equals value
+#if defined(_WIN32)
+    WaitOnAddress((volatile VOID*)pState, &value, sizeof(value), INFINITE);
+#elif defined(__linux__)
+    syscall(SYS_futex, pState, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+    (void)pState;
+    (void)value;
+    std::this_thread::yield();
+#endif
+}
+
+//------------------------------------------------------------------------------
+// _LK_Wake
+//------------------------------------------------------------------------------
+void _LK_Wake(LK_SpinLock* pLock)
+{
+#if defined(_WIN32)
+    WakeByAddressSingle((PVOID)&pLock->state);
+#elif defined(__linux__)
+    syscall(SYS_futex, &pLock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)pLock;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// _LK_LockContended
+//------------------------------------------------------------------------------
+void _LK_LockContended(LK_SpinLock* pLock)
+{
+#ifdef LK_LOCK_STATS
+    UINT64 start = LK_NowNs();
+#endif
+    UINT32 maxSpins = pLock->spins ? pLock->spins : LK_MIN_SPINS;
+    UINT32 limit = (maxSpins * 2 < LK_MAX_SPINS) ? maxSpins * 2 : LK_MAX_SPINS;
+    UINT32 spin;
+    INT32 spins;
+
+    // Spin while the holder is likely to release the lock soon
+    for (spin = 0; spin < limit; spin++)
+    {
+        LK_CpuRelax();
+        if (pLock->state == 0 && ATOMIC_Cas32(&pLock->state, 0, 1))
+            break;
+    }
+
+    if (spin == limit)
+    {
+        // Park until woken. Marking the lock as having waiters makes the
+        // holder wake a parked thread on release.
+        while (ATOMIC_Exchange32(&pLock->state, 2) != 0)
+            LK_Park(&pLock->state, 2);
+    }
+
+    // Now the lock is held, move the spin count towards the spins needed
+    spins = (INT32)maxSpins + ((INT32)spin - (INT32)maxSpins) / 8;
+    pLock->spins = (spins < LK_MIN_SPINS) ? LK_MIN_SPINS : (UINT32)spins;
+
+#ifdef LK_LOCK_STATS
+    pLock->stats.contended++;
+    pLock->stats.waitNs += LK_NowNs() - start;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// LK_Init
+//------------------------------------------------------------------------------
+LOCK_HANDLE LK_Init(LK_SpinLock* pLock)
+{
+    ASSERT_TRUE(pLock);
+    pLock->state = 0;
+    pLock->spins = 0;
+#ifdef LK_LOCK_STATS
+    pLock->stats = LK_Stats();
+#endif
+    return pLock;
+}
+
+//------------------------------------------------------------------------------
+// LK_Create
+//------------------------------------------------------------------------------
+LOCK_HANDLE LK_Create(void)
+{
+    return LK_Init(new LK_SpinLock);
+}
+
+//------------------------------------------------------------------------------
+// LK_Destroy
+//------------------------------------------------------------------------------
+void LK_Destroy(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    delete (LK_SpinLock*)(hLock);
 }
 
+//------------------------------------------------------------------------------
+// LK_Lock
+//------------------------------------------------------------------------------
+void LK_Lock(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    LK_SpinAcquire((LK_SpinLock*)(hLock));
+}
+
+//------------------------------------------------------------------------------
+// LK_Unlock
+//------------------------------------------------------------------------------
+void LK_Unlock(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    LK_SpinRelease((LK_SpinLock*)(hLock));
+}
+
+//------------------------------------------------------------------------------
+// LK_TryLock
+//------------------------------------------------------------------------------
+BOOL LK_TryLock(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    LK_SpinLock* lock = (LK_SpinLock*)(hLock);
+    if (!ATOMIC_Cas32(&lock->state, 0, 1))
+        return FALSE;
+#ifdef LK_LOCK_STATS
+    lock->stats.acquisitions++;
+#endif
+    return TRUE;
+}
+
+#ifdef LK_LOCK_STATS
+//------------------------------------------------------------------------------
+// LK_GetStats
+//------------------------------------------------------------------------------
+void LK_GetStats(LOCK_HANDLE hLock, LK_Stats* pStats)
+{
+    ASSERT_TRUE(hLock);
+    ASSERT_TRUE(pStats);
+    LK_SpinLock* lock = (LK_SpinLock*)(hLock);
+
+    // Copy under the lock without counting this acquisition
+    while (!ATOMIC_Cas32(&lock->state, 0, 1))
+        std::this_thread::yield();
+    *pStats = lock->stats;
+    LK_SpinRelease(lock);
+}
+#endif
+#endif // LK_SPIN_LOCK
@@ -3,24 +3,97 @@
 
 #include "DataTypes.h"
 
+// Define LK_SPIN_LOCK to replace the heap allocated std::mutex with a lock
+// word that is acquired inline by a single CAS. A contended lock spins for
+// an adaptive number of iterations, then parks the thread (a futex on
+// Linux, WaitOnAddress on Windows). Use LK_Init() to store the lock within
+// another object instead of allocating it with LK_Create().
+// #define LK_SPIN_LOCK
+
+// Define LK_LOCK_STATS to count acquisitions, contended acquisitions and
+// total wait time per lock. See LK_GetStats().
+// #define LK_LOCK_STATS
+
+#ifdef LK_SPIN_LOCK
+    #include "Atomic.h"
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void* LOCK_HANDLE;
 
+// Lock contention statistics
+typedef struct
+{
+    UINT64 acquisitions;
+    UINT64 contended;
+    UINT64 waitNs;
+} LK_Stats;
+
+#ifdef LK_SPIN_LOCK
+// Spin lock storage. Zero initialized storage is an unlocked lock.
+typedef struct
+{
+    // 0 is unlocked, 1 is locked and 2 is locked with parked waiters
+    volatile UINT32 state;
+
+    // Adaptive spin count learned from recent contended acquisitions
+    UINT32 spins;
+#ifdef LK_LOCK_STATS
+    LK_Stats stats;
+#endif
+} LK_SpinLock;
+#endif
+
 #define LK_CREATE()     LK_Create()
 #define LK_DESTROY(h)   LK_Destroy(h)
-#define LK_LOCK(h)      LK_Lock(h)
-#define LK_UNLOCK(h)    LK_Unlock(h)
+#ifndef LK_SPIN_LOCK
+    #define LK_LOCK(h)      LK_Lock(h)
+    #define LK_UNLOCK(h)    LK_Unlock(h)
+#else
+    #define LK_LOCK(h)      LK_SpinAcquire((LK_SpinLock*)(h))
+    #define LK_UNLOCK(h)    LK_SpinRelease((LK_SpinLock*)(h))
+#endif
+#define LK_TRYLOCK(h)   LK_TryLock(h)
 
 LOCK_HANDLE LK_Create(void);
 void LK_Destroy(LOCK_HANDLE hLock);
 void LK_Lock(LOCK_HANDLE hLock);
 void LK_Unlock(LOCK_HANDLE hLock);
+BOOL LK_TryLock(LOCK_HANDLE hLock);
+#ifdef LK_LOCK_STATS
+void LK_GetStats(LOCK_HANDLE hLock, LK_Stats* pStats);
+#endif
+
+#ifdef LK_SPIN_LOCK
+LOCK_HANDLE LK_Init(LK_SpinLock* pLock);
+
+// Private functions
+void _LK_LockContended(LK_SpinLock* pLock);
+void _LK_Wake(LK_SpinLock* pLock);
+
+// Acquire the lock. The uncontended case is a single CAS.
+static __inline void LK_SpinAcquire(LK_SpinLock* pLock)
+{
+    if (!ATOMIC_Cas32(&pLock->state, 0, 1))
+        _LK_LockContended(pLock);
+#ifdef LK_LOCK_STATS
+    pLock->stats.acquisitions++;
+#endif
+}
+
+// Release the lock, waking one parked thread if any
+static __inline void LK_SpinRelease(LK_SpinLock* pLock)
+{
+    if (ATOMIC_Exchange32(&pLock->state, 0) == 2)
+        _LK_Wake(pLock);
+}
+#endif
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif 
+#endif
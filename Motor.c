@@ -13,6 +13,10 @@ enum States
     ST_MAX_STATES
 };
 
+// Fixed block pool sized for MotorData event data
+#define MAX_MOTOR_DATA  4
+EVENT_POOL_DEFINE(MotorData, MAX_MOTOR_DATA)
+
 // State machine state functions
 STATE_DECLARE(Idle, NoEventData)
 STATE_DECLARE(Stop, NoEventData)
@@ -56,7 +60,7 @@ EVENT_DEFINE(MTR_Halt, NoEventData)
 // State machine sits here when motor is not running
 STATE_DEFINE(Idle, NoEventData)
 {
-    printf("%s ST_Idle\n", self->name);
+    printf("%s ST_Idle\n", SM_GetName());
 }
 
 // Stop the motor 
@@ -67,7 +71,7 @@ STATE_DEFINE(Stop, NoEventData)
     pInstance->currentSpeed = 0;
 
     // Perform the stop motor processing here
-    printf("%s ST_Stop: %d\n", self->name, pInstance->currentSpeed);
+    printf("%s ST_Stop: %d\n", SM_GetName(), pInstance->currentSpeed);
 
     // Transition to ST_Idle via an internal event
     SM_InternalEvent(ST_IDLE, NULL);
@@ -83,7 +87,7 @@ STATE_DEFINE(Start, MotorData)
     pInstance->currentSpeed = pEventData->speed;
 
     // Set initial motor speed processing here
-    printf("%s ST_Start: %d\n", self->name, pInstance->currentSpeed);
+    printf("%s ST_Start: %d\n", SM_GetName(), pInstance->currentSpeed);
 }
 
 // Changes the motor speed once the motor is moving
@@ -96,7 +100,7 @@ STATE_DEFINE(ChangeSpeed, MotorData)
     pInstance->currentSpeed = pEventData->speed;
 
     // Perform the change motor speed here
-    printf("%s ST_ChangeSpeed: %d\n", self->name, pInstance->currentSpeed);
+    printf("%s ST_ChangeSpeed: %d\n", SM_GetName(), pInstance->currentSpeed);
 }
 
 // Get current speed
@@ -16,6 +16,9 @@ typedef struct
     INT speed;
 } MotorData;
 
+// Event data pool
+EVENT_POOL_DECLARE(MotorData)
+
 // State machine event functions
 EVENT_DECLARE(MTR_SetSpeed, MotorData)
 EVENT_DECLARE(MTR_Halt, NoEventData)
@@ -0,0 +1,227 @@
+#include "SMCoroutine.h"
+#include "Fault.h"
+#include <algorithm>
+
+// A state machine instance and one of its states
+typedef std::pair<SM_StateMachine*, BYTE> SMWaitKey;
+
+// Protects the waiters
+static std::mutex _waitersLock;
+
+// Coroutines waiting for each state machine instance and state, so a 
+// transition only visits the coroutines waiting for it
+static std::map<SMWaitKey, std::vector<std::shared_ptr<SMWaiter>>> _waiters;
+
+// Holds the state machine instance lock (SM_LOCK) for the guard's lifetime.
+// Taken before _waitersLock, the same order as the state engine calling
+// SMCoroutine_Observer.
+class SMInstanceLock
+{
+public:
+    explicit SMInstanceLock(SM_StateMachine* sm) : m_sm(sm) { _SM_LockInstance(m_sm); }
+    ~SMInstanceLock() { _SM_UnlockInstance(m_sm); }
+    SMInstanceLock(const SMInstanceLock&) = delete;
+    SMInstanceLock& operator=(const SMInstanceLock&) = delete;
+
+private:
+    SM_StateMachine* m_sm;
+};
+
+//------------------------------------------------------------------------------
+// SMCoroutine_Remove
+//------------------------------------------------------------------------------
+static void SMCoroutine_Remove(const std::shared_ptr<SMWaiter>& waiter)
+{
+    // Caller must hold _waitersLock
+    auto it = _waiters.find(SMWaitKey(waiter->sm, waiter->state));
+    if (it == _waiters.end())
+        return;
+
+    it->second.erase(std::remove(it->second.begin(), it->second.end(), waiter), it->second.end());
+    if (it->second.empty())
+        _waiters.erase(it);
+}
+
+//------------------------------------------------------------------------------
+// SMCoroutine_Observer
+//------------------------------------------------------------------------------
+static void SMCoroutine_Observer(SM_StateMachine* self, BYTE state)
+{
+    std::lock_guard<std::mutex> lock(_waitersLock);
+
+    auto it = _waiters.find(SMWaitKey(self, state));
+    if (it == _waiters.end())
+        return;
+
+    // Hand each coroutine waiting for this state to its executor and cancel
+    // its timeout. The coroutine must not resume within the state engine.
+    for (std::shared_ptr<SMWaiter>& waiter : it->second)
+    {
+        waiter->pending = false;
+        if (waiter->hasTimer)
+            waiter->executor->Cancel(waiter->timer);
+        std::shared_ptr<SMWaiter> resumed = waiter;
+        waiter->executor->Post([resumed]() { resumed->handle.resume(); });
+    }
+    _waiters.erase(it);
+}
+
+//------------------------------------------------------------------------------
+// SMCoroutine::SMCoroutine
+//------------------------------------------------------------------------------
+SMCoroutine::SMCoroutine(SM_StateMachine* sm, SMExecutor& executor) :
+    m_sm(sm), m_executor(executor)
+{
+    ASSERT_TRUE(sm);
+
+    // Only this instance calls the observer, so the state functions of any
+    // other instance never take _waitersLock
+    _SM_SetObserver(sm, SMCoroutine_Observer);
+}
+
+//------------------------------------------------------------------------------
+// SMCoroutine::StateAwaiter::StateAwaiter
+//------------------------------------------------------------------------------
+SMCoroutine::StateAwaiter::StateAwaiter(SMCoroutine& owner, BYTE state, std::chrono::nanoseconds timeout) :
+    m_owner(owner), m_timeout(timeout),
+    m_waiter(std::make_shared<SMWaiter>(SMWaiter{ owner.m_sm, state, nullptr, &owner.m_executor, false, false, false, 0 }))
+{
+}
+
+//------------------------------------------------------------------------------
+// SMCoroutine::StateAwaiter::await_ready
+//------------------------------------------------------------------------------
+bool SMCoroutine::StateAwaiter::await_ready() const
+{
+    SMInstanceLock instanceLock(m_owner.m_sm);
+    return m_owner.m_sm->currentState == m_waiter->state;
+}
+
+//------------------------------------------------------------------------------
+// SMCoroutine::StateAwaiter::await_suspend
+//------------------------------------------------------------------------------
+bool SMCoroutine::StateAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    std::shared_ptr<SMWaiter> waiter = m_waiter;
+    SMInstanceLock instanceLock(m_owner.m_sm);
+    std::lock_guard<std::mutex> lock(_waitersLock);
+
+    // Don't suspend if the state was reached since await_ready()
+    if (m_owner.m_sm->currentState == waiter->state)
+        return false;
+
+    waiter->handle = handle;
+    waiter->pending = true;
+    _waiters[SMWaitKey(waiter->sm, waiter->state)].push_back(waiter);
+
+    if (m_timeout.count() > 0)
+    {
+        // Resume with a timeout unless the state is reached first. The timer
+        // is set while holding _waitersLock so the observer can cancel it.
+        waiter->timer = m_owner.m_executor.PostAt(std::chrono::steady_clock::now() + m_timeout, [waiter]() {
+            {
+                std::lock_guard<std::mutex> lock(_waitersLock);
+                if (!waiter->pending)
+                    return;
+                waiter->pending = false;
+                waiter->timedOut = true;
+                SMCoroutine_Remove(waiter);
+            }
+            waiter->handle.resume();
+        });
+        waiter->hasTimer = true;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// SMLoopExecutor::Post
+//------------------------------------------------------------------------------
+void SMLoopExecutor::Post(std::function<void()> work)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_work.push_back(std::move(work));
+    }
+    m_cv.notify_one();
+}
+
+//------------------------------------------------------------------------------
+// SMLoopExecutor::PostAt
+//------------------------------------------------------------------------------
+SMExecutor::TimerId SMLoopExecutor::PostAt(TimePoint when, std::function<void()> work)
+{
+    TimerId timer;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        timer = m_nextTimer++;
+        m_timers.emplace(std::make_pair(when, timer), std::move(work));
+        m_timerDue.emplace(timer, when);
+    }
+    m_cv.notify_one();
+    return timer;
+}
+
+//------------------------------------------------------------------------------
+// SMLoopExecutor::Cancel
+//------------------------------------------------------------------------------
+void SMLoopExecutor::Cancel(TimerId timer)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // A timer already run or cancelled is no longer found
+    auto it = m_timerDue.find(timer);
+    if (it == m_timerDue.end())
+        return;
+
+    m_timers.erase(std::make_pair(it->second, timer));
+    m_timerDue.erase(it);
+}
+
+//------------------------------------------------------------------------------
+// SMLoopExecutor::RunOne
+//------------------------------------------------------------------------------
+bool SMLoopExecutor::RunOne()
+{
+    std::function<void()> work;
+
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        for (;;)
+        {
+            // Posted work runs first, then any due timer
+            if (!m_work.empty())
+            {
+                work = std::move(m_work.front());
+                m_work.pop_front();
+                break;
+            }
+            if (m_timers.empty())
+                return false;
+            auto due = m_timers.begin();
+            if (due->first.first <= std::chrono::steady_clock::now())
+            {
+                work = std::move(due->second);
+                m_timerDue.erase(due->first.second);
+                m_timers.erase(due);
+                break;
+            }
+            TimePoint when = due->first.first;
+            m_cv.wait_until(lock, when);
+        }
+    }
+
+    work();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// SMLoopExecutor::Run
+//------------------------------------------------------------------------------
+void SMLoopExecutor::Run()
+{
+    while (RunOne())
+        ;
+}
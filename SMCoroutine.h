@@ -0,0 +1,239 @@
+// The SMCoroutine module is a C++20 coroutine adapter for the C state
+// machines. A coroutine awaits a state machine reaching a state, posts
+// events and sleeps without blocking a thread. Waiting coroutines are
+// resumed on an SMExecutor chosen by the caller, never from within the
+// state engine.
+//
+// SMCoroutine installs the transition observer (see 
+// SM_SetTransitionObserver()) of the state machine instance it is 
+// constructed with, so the instance must have no other observer. With 
+// SM_LOCK the instance lock is held while the current state is read. 
+// Without it, the instance must only receive events on the executor thread.
+//
+// SMCoroutine requires C++20. Configure CMake with -DSM_COROUTINE=ON to 
+// build it along with the SMCoroutineDemo example.
+//
+// #include "SMCoroutine.h"
+// #include "CentrifugeTest.h"
+//
+// SMTask RunTest(SMCoroutine& cfg)
+// {
+//     co_await cfg.post(CFG_Start, (NoEventData*)NULL);
+//     if (!co_await cfg.until_state(CFG_STATE_COMPLETED, std::chrono::seconds(5)))
+//         co_await cfg.post(CFG_Cancel, (NoEventData*)NULL);
+// }
+//
+// SMLoopExecutor loop;
+// SMCoroutine cfg(SM_GetObj(CentrifugeTestSM), loop);
+// SMTask task = RunTest(cfg);
+// loop.Run();
+
+#ifndef _SM_COROUTINE_H
+#define _SM_COROUTINE_H
+
+#include "StateMachine.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Runs the work that resumes coroutines
+class SMExecutor
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    typedef UINT64 TimerId;
+
+    virtual ~SMExecutor() = default;
+
+    // Run work as soon as possible. May be called from any thread.
+    virtual void Post(std::function<void()> work) = 0;
+
+    // Run work no sooner than when. May be called from any thread. Returns
+    // an id used to cancel the timer.
+    virtual TimerId PostAt(TimePoint when, std::function<void()> work) = 0;
+
+    // Discard a timer that has not yet run. May be called from any thread.
+    virtual void Cancel(TimerId timer) = 0;
+};
+
+// An executor that runs posted work and due timers on the thread calling
+// RunOne() or Run()
+class SMLoopExecutor : public SMExecutor
+{
+public:
+    void Post(std::function<void()> work) override;
+    TimerId PostAt(TimePoint when, std::function<void()> work) override;
+    void Cancel(TimerId timer) override;
+
+    // Run one item of work, waiting for the next timer if necessary.
+    // Returns false if no work or timers remain.
+    bool RunOne();
+
+    // Run until no work or timers remain
+    void Run();
+
+private:
+    // Timers ordered by due time, then by the order posted
+    typedef std::map<std::pair<TimePoint, TimerId>, std::function<void()>> Timers;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_work;
+    Timers m_timers;
+    std::unordered_map<TimerId, TimePoint> m_timerDue;
+    TimerId m_nextTimer = 0;
+};
+
+// The return type of a coroutine started on a state machine. The coroutine
+// starts immediately and its frame is released when it completes.
+class SMTask
+{
+public:
+    struct promise_type
+    {
+        std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+
+        SMTask get_return_object() { return SMTask(done); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { *done = true; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    // Returns true once the coroutine has completed
+    bool Done() const { return *m_done; }
+
+private:
+    explicit SMTask(std::shared_ptr<std::atomic<bool>> done) : m_done(done) {}
+
+    std::shared_ptr<std::atomic<bool>> m_done;
+};
+
+// A coroutine waiting for a state machine to execute a state
+struct SMWaiter
+{
+    SM_StateMachine* sm;
+    BYTE state;
+    std::coroutine_handle<> handle;
+    SMExecutor* executor;
+    bool pending;
+    bool timedOut;
+    bool hasTimer;
+    SMExecutor::TimerId timer;
+};
+
+// Awaitable state machine adapter
+class SMCoroutine
+{
+public:
+    SMCoroutine(SM_StateMachine* sm, SMExecutor& executor);
+
+    // Awaitable for the state machine executing state. Completes at once if
+    // the state machine is already in state.
+    class StateAwaiter
+    {
+    public:
+        StateAwaiter(SMCoroutine& owner, BYTE state, std::chrono::nanoseconds timeout);
+        bool await_ready() const;
+        bool await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const { return !m_waiter->timedOut; }
+
+    private:
+        SMCoroutine& m_owner;
+        std::chrono::nanoseconds m_timeout;
+        std::shared_ptr<SMWaiter> m_waiter;
+    };
+
+    // Awaitable that generates an event on the executor, then resumes
+    template <typename T>
+    class PostAwaiter
+    {
+    public:
+        typedef void (*EventFunc)(SM_StateMachine* self, T* pEventData);
+
+        PostAwaiter(SMCoroutine& owner, EventFunc eventFunc, T* pEventData) :
+            m_owner(owner), m_eventFunc(eventFunc), m_pEventData(pEventData) {}
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            SM_StateMachine* sm = m_owner.m_sm;
+            EventFunc eventFunc = m_eventFunc;
+            T* pEventData = m_pEventData;
+            m_owner.m_executor.Post([sm, eventFunc, pEventData, handle]() {
+                eventFunc(sm, pEventData);
+                handle.resume();
+            });
+        }
+        void await_resume() const {}
+
+    private:
+        SMCoroutine& m_owner;
+        EventFunc m_eventFunc;
+        T* m_pEventData;
+    };
+
+    // Awaitable that resumes after a delay
+    class SleepAwaiter
+    {
+    public:
+        SleepAwaiter(SMExecutor& executor, std::chrono::nanoseconds delay) :
+            m_executor(executor), m_delay(delay) {}
+        bool await_ready() const { return m_delay.count() <= 0; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            m_executor.PostAt(std::chrono::steady_clock::now() + m_delay,
+                [handle]() { handle.resume(); });
+        }
+        void await_resume() const {}
+
+    private:
+        SMExecutor& m_executor;
+        std::chrono::nanoseconds m_delay;
+    };
+
+    // co_await until_state(state) waits for the state machine to execute state
+    StateAwaiter until_state(BYTE state)
+    {
+        return StateAwaiter(*this, state, std::chrono::nanoseconds::zero());
+    }
+
+    // co_await until_state(state, timeout) returns false if timeout expires first
+    template <typename Rep, typename Period>
+    StateAwaiter until_state(BYTE state, std::chrono::duration<Rep, Period> timeout)
+    {
+        return StateAwaiter(*this, state,
+            std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout),
+                std::chrono::nanoseconds(1)));
+    }
+
+    // co_await post(eventFunc, pEventData) generates an event
+    template <typename T>
+    PostAwaiter<T> post(void (*eventFunc)(SM_StateMachine*, T*), T* pEventData)
+    {
+        return PostAwaiter<T>(*this, eventFunc, pEventData);
+    }
+
+    // co_await sleep_for(delay) resumes after delay
+    template <typename Rep, typename Period>
+    SleepAwaiter sleep_for(std::chrono::duration<Rep, Period> delay)
+    {
+        return SleepAwaiter(m_executor,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(delay));
+    }
+
+private:
+    SM_StateMachine* m_sm;
+    SMExecutor& m_executor;
+};
+
+#endif // _SM_COROUTINE_H
@@ -0,0 +1,69 @@
+// SMCoroutineDemo runs the CentrifugeTest state machine from coroutines. One
+// coroutine starts the test and awaits completion with a timeout while a
+// second coroutine polls the test each millisecond. The demo fails if the
+// test does not complete or the loop is held open by the timeout timer.
+//
+// Configure CMake with -DSM_COROUTINE=ON to build SMCoroutineDemo.
+
+#include "SMCoroutine.h"
+#include "CentrifugeTest.h"
+#include "fb_allocator.h"
+#include <stdio.h>
+
+// Time allowed for the centrifuge test to complete
+#define DEMO_TIMEOUT    std::chrono::seconds(5)
+
+//------------------------------------------------------------------------------
+// DEMO_RunTest
+//------------------------------------------------------------------------------
+static SMTask DEMO_RunTest(SMCoroutine& cfg, bool& completed)
+{
+    co_await cfg.post(CFG_Start, (NoEventData*)NULL);
+    completed = co_await cfg.until_state(CFG_STATE_COMPLETED, DEMO_TIMEOUT);
+    if (!completed)
+        co_await cfg.post(CFG_Cancel, (NoEventData*)NULL);
+}
+
+//------------------------------------------------------------------------------
+// DEMO_PollTest
+//------------------------------------------------------------------------------
+static SMTask DEMO_PollTest(SMCoroutine& cfg, const SMTask& runTest)
+{
+    while (!runTest.Done())
+    {
+        co_await cfg.sleep_for(std::chrono::milliseconds(1));
+        if (CFG_IsPollActive())
+            co_await cfg.post(CFG_Poll, (NoEventData*)NULL);
+    }
+}
+
+//------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------
+int main(void)
+{
+    bool completed = false;
+
+    ALLOC_Init();
+#ifdef USE_SM_ALLOCATOR
+    SMALLOC_Init();
+#endif
+
+    SMLoopExecutor loop;
+    SMCoroutine cfg(SM_GetObj(CentrifugeTestSM), loop);
+
+    auto start = std::chrono::steady_clock::now();
+
+    SMTask runTest = DEMO_RunTest(cfg, completed);
+    SMTask pollTest = DEMO_PollTest(cfg, runTest);
+    loop.Run();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("CentrifugeTest %s in %.1f ms\n", completed ? "completed" : "timed out", elapsed.count());
+
+    ALLOC_Term();
+
+    // The loop returns once no work or timers remain, so a completed test
+    // must not wait out its cancelled timeout
+    return (completed && elapsed < DEMO_TIMEOUT) ? 0 : 1;
+}
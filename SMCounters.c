@@ -0,0 +1,143 @@
+#include "SMCounters.h"
+#include "Atomic.h"
+#include "Fault.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef SM_COUNTERS
+
+// Exported metrics
+typedef struct
+{
+    const CHAR* name;
+    const CHAR* help;
+    size_t offset;
+} SMCNT_Metric;
+
+static const SMCNT_Metric _metrics[] =
+{
+    { "sm_events_received_total", "External events received.", offsetof(SM_Counters, eventsReceived) },
+    { "sm_events_ignored_total", "External events ignored in the current state.", offsetof(SM_Counters, eventsIgnored) },
+    { "sm_guard_rejects_total", "Transitions rejected by a guard condition.", offsetof(SM_Counters, guardRejects) },
+    { "sm_self_transitions_total", "States executed without changing state.", offsetof(SM_Counters, selfTransitions) },
+    { "sm_transitions_total", "States executed after changing state.", offsetof(SM_Counters, transitions) },
+    { "sm_internal_events_total", "Internal events generated by a state.", offsetof(SM_Counters, internalEvents) },
+};
+
+#define SMCNT_NUM_METRICS   (sizeof(_metrics) / sizeof(_metrics[0]))
+
+//----------------------------------------------------------------------------
+// SMCNT_Sum
+//----------------------------------------------------------------------------
+static UINT64 SMCNT_Sum(SM_CounterSet* pSet, size_t offset)
+{
+    UINT64 total = 0;
+    UINT32 shard;
+
+    for (shard = 0; shard < SM_COUNTER_SHARDS; shard++)
+        total += ATOMIC_Load64((volatile UINT64*)((BYTE*)&pSet->shards[shard].counters + offset));
+    return total;
+}
+
+//----------------------------------------------------------------------------
+// SMCNT_Get
+//----------------------------------------------------------------------------
+BOOL SMCNT_Get(const CHAR* name, SM_Counters* pCounters)
+{
+    SM_CounterSet* pSet;
+    UINT32 metric;
+
+    ASSERT_TRUE(name);
+    ASSERT_TRUE(pCounters);
+
+    for (pSet = (SM_CounterSet*)ATOMIC_LoadPtr((void* volatile*)&SM_CounterSets); pSet; pSet = pSet->pNext)
+    {
+        if (strcmp(pSet->name, name) == 0)
+        {
+            for (metric = 0; metric < SMCNT_NUM_METRICS; metric++)
+                *(UINT64*)((BYTE*)pCounters + _metrics[metric].offset) = SMCNT_Sum(pSet, _metrics[metric].offset);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------------
+// SMCNT_Export
+//----------------------------------------------------------------------------
+void SMCNT_Export(SMCNT_WriteFunc writeFunc, void* context)
+{
+    CHAR line[256];
+    SM_CounterSet* pHead;
+    SM_CounterSet* pSet;
+    UINT32 metric;
+
+    ASSERT_TRUE(writeFunc);
+
+    // Sets only ever get added at the head, so walking from a snapshot of
+    // the head is safe while other threads register
+    pHead = (SM_CounterSet*)ATOMIC_LoadPtr((void* volatile*)&SM_CounterSets);
+
+    for (metric = 0; metric < SMCNT_NUM_METRICS; metric++)
+    {
+        snprintf(line, sizeof(line), "# HELP %s %s\n", _metrics[metric].name, _metrics[metric].help);
+        writeFunc(line, context);
+        snprintf(line, sizeof(line), "# TYPE %s counter\n", _metrics[metric].name);
+        writeFunc(line, context);
+
+        for (pSet = pHead; pSet; pSet = pSet->pNext)
+        {
+            snprintf(line, sizeof(line), "%s{machine=\"%s\"} %llu\n", _metrics[metric].name,
+                pSet->name, (unsigned long long)SMCNT_Sum(pSet, _metrics[metric].offset));
+            writeFunc(line, context);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// SMCNT_WriteFile
+//----------------------------------------------------------------------------
+static void SMCNT_WriteFile(const CHAR* text, void* context)
+{
+    fputs(text, (FILE*)context);
+}
+
+//----------------------------------------------------------------------------
+// SMCNT_ExportFile
+//----------------------------------------------------------------------------
+BOOL SMCNT_ExportFile(const CHAR* path)
+{
+    CHAR tempPath[260];
+    FILE* fp;
+    BOOL ok;
+
+    ASSERT_TRUE(path);
+
+    // Write a temporary file then rename it, so a scraper never reads a
+    // partially written file
+    if (snprintf(tempPath, sizeof(tempPath), "%s.tmp", path) >= (int)sizeof(tempPath))
+        return FALSE;
+
+    fp = fopen(tempPath, "w");
+    if (!fp)
+        return FALSE;
+
+    SMCNT_Export(SMCNT_WriteFile, fp);
+
+    ok = (ferror(fp) == 0);
+    if (fclose(fp) != 0)
+        ok = FALSE;
+
+    // The C library rename() does not replace an existing file on Windows
+#if defined(_WIN32)
+    remove(path);
+#endif
+    if (!ok || rename(tempPath, path) != 0)
+    {
+        remove(tempPath);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+#endif // SM_COUNTERS
@@ -0,0 +1,36 @@
+// The SMCounters module exports the state machine runtime counters kept by
+// the state engine when SM_COUNTERS is defined within StateMachine.h. The
+// shards of each state machine are summed and written in the Prometheus
+// text exposition format, either to a callback or to a file for a scraper.
+//
+// A state machine appears once it has received its first event.
+//
+// #include "SMCounters.h"
+// SMCNT_ExportFile("/var/run/myapp/sm.prom");
+
+#ifndef _SM_COUNTERS_H
+#define _SM_COUNTERS_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef SM_COUNTERS
+
+// Called with each line of exported text, including the newline
+typedef void (*SMCNT_WriteFunc)(const CHAR* text, void* context);
+
+BOOL SMCNT_Get(const CHAR* name, SM_Counters* pCounters);
+void SMCNT_Export(SMCNT_WriteFunc writeFunc, void* context);
+BOOL SMCNT_ExportFile(const CHAR* path);
+
+#endif // SM_COUNTERS
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_COUNTERS_H
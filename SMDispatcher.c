@@ -0,0 +1,235 @@
+#include "SMDispatcher.h"
+#include "Fault.h"
+#if defined(__linux__)
+    #include <sys/eventfd.h>
+    #include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------
+// SMD_Signal
+//----------------------------------------------------------------------------
+static void SMD_Signal(SM_Dispatcher* self)
+{
+#if defined(__linux__)
+    UINT64 one = 1;
+
+    // Make the fd readable
+    if (write(self->fd, &one, sizeof(one)) != sizeof(one))
+        ASSERT();
+#endif
+    self->signalled = TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SMD_ClearSignal
+//----------------------------------------------------------------------------
+static void SMD_ClearSignal(SM_Dispatcher* self)
+{
+#if defined(__linux__)
+    UINT64 value;
+
+    // Reading an eventfd resets its counter, so the fd is no longer readable
+    if (read(self->fd, &value, sizeof(value)) != sizeof(value))
+        ASSERT();
+#endif
+    self->signalled = FALSE;
+}
+
+//----------------------------------------------------------------------------
+// SMD_Init
+//----------------------------------------------------------------------------
+void SMD_Init(SM_Dispatcher* self)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->events && self->maxEvents);
+
+#ifdef SMD_LATENCY
+    // Ensure SMLAT_Init() was called before any event is recorded
+    ASSERT_TRUE(SMLAT_IsInitialized());
+#endif
+
+    self->head = 0;
+    self->count = 0;
+    self->signalled = FALSE;
+    self->dropped = 0;
+    self->hLock = LK_CREATE();
+
+#if defined(__linux__)
+    self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ASSERT_TRUE(self->fd >= 0);
+#else
+    self->fd = -1;
+#endif
+}
+
+//----------------------------------------------------------------------------
+// SMD_Term
+//----------------------------------------------------------------------------
+void SMD_Term(SM_Dispatcher* self)
+{
+    ASSERT_TRUE(self);
+
+    // Free the data of any events never executed
+    while (self->count)
+    {
+        if (self->events[self->head].pEventData)
+            SM_XFree(self->events[self->head].pEventData);
+        self->head = (self->head + 1) % self->maxEvents;
+        self->count--;
+    }
+
+#if defined(__linux__)
+    if (self->fd >= 0)
+        close(self->fd);
+#endif
+    self->fd = -1;
+
+    LK_DESTROY(self->hLock);
+    self->hLock = NULL;
+}
+
+//----------------------------------------------------------------------------
+// SMD_Post
+//----------------------------------------------------------------------------
+BOOL SMD_Post(SM_Dispatcher* self, SM_StateMachine* sm, SM_EventFunc eventFunc, void* pEventData)
+{
+    SM_QueuedEvent* pEvent;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(sm);
+    ASSERT_TRUE(eventFunc);
+
+    // Ensure SMD_Init() was called on the dispatcher
+    ASSERT_TRUE(self->hLock);
+
+    LK_LOCK(self->hLock);
+
+    if (self->count == self->maxEvents)
+    {
+        self->dropped++;
+        LK_UNLOCK(self->hLock);
+
+#ifndef SMD_DROP_ON_FULL
+        // Queue full. Increase the SMD_DEFINE() maxEvents or define 
+        // SMD_DROP_ON_FULL.
+        ASSERT();
+#endif
+
+        // Queue full, delete the event data as for an ignored event
+        if (pEventData)
+            SM_XFree(pEventData);
+        return FALSE;
+    }
+
+    pEvent = &self->events[(self->head + self->count) % self->maxEvents];
+    pEvent->self = sm;
+    pEvent->eventFunc = eventFunc;
+    pEvent->pEventData = pEventData;
+#ifdef SMD_LATENCY
+    // Read the clock once the event is accepted
+    pEvent->postNs = SMLAT_NowNs();
+#endif
+    self->count++;
+
+    // Only the first pending event needs a wakeup
+    if (!self->signalled)
+        SMD_Signal(self);
+
+    LK_UNLOCK(self->hLock);
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SMD_ProcessPending
+//----------------------------------------------------------------------------
+UINT32 SMD_ProcessPending(SM_Dispatcher* self, UINT32 max)
+{
+    SM_QueuedEvent event;
+    UINT32 processed = 0;
+#ifdef SMD_LATENCY
+    UINT64 startNs;
+#endif
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->hLock);
+
+    LK_LOCK(self->hLock);
+
+    while (processed < max && self->count)
+    {
+        event = self->events[self->head];
+        self->head = (self->head + 1) % self->maxEvents;
+        self->count--;
+
+        // Execute the event without holding the lock, so state functions
+        // may post further events
+        LK_UNLOCK(self->hLock);
+#ifdef SMD_LATENCY
+        startNs = SMLAT_NowNs();
+        event.eventFunc(event.self, event.pEventData);
+        SMLAT_Record(event.self, event.eventFunc, startNs - event.postNs, SMLAT_NowNs() - startNs);
+#else
+        event.eventFunc(event.self, event.pEventData);
+#endif
+        processed++;
+        LK_LOCK(self->hLock);
+    }
+
+    // The fd stays readable until the queue is drained. Events left pending
+    // signal again, since an edge-triggered poller is not woken by an fd 
+    // that stays readable.
+    if (!self->count && self->signalled)
+        SMD_ClearSignal(self);
+    else if (self->count)
+        SMD_Signal(self);
+
+    LK_UNLOCK(self->hLock);
+
+    return processed;
+}
+
+//----------------------------------------------------------------------------
+// SMD_GetFd
+//----------------------------------------------------------------------------
+int SMD_GetFd(SM_Dispatcher* self)
+{
+    ASSERT_TRUE(self);
+    return self->fd;
+}
+
+//----------------------------------------------------------------------------
+// SMD_GetDropped
+//----------------------------------------------------------------------------
+UINT32 SMD_GetDropped(SM_Dispatcher* self)
+{
+    UINT32 dropped;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->hLock);
+
+    LK_LOCK(self->hLock);
+    dropped = self->dropped;
+    LK_UNLOCK(self->hLock);
+
+    return dropped;
+}
+
+#ifdef SM_BUDGET
+//----------------------------------------------------------------------------
+// SMD_Resume
+//----------------------------------------------------------------------------
+static void SMD_Resume(SM_StateMachine* self, void* pEventData)
+{
+    (void)pEventData;
+    _SM_Resume(self);
+}
+
+//----------------------------------------------------------------------------
+// SMD_PostResume
+//----------------------------------------------------------------------------
+BOOL SMD_PostResume(SM_Dispatcher* self, SM_StateMachine* sm)
+{
+    return SMD_Post(self, sm, SMD_Resume, NULL);
+}
+#endif
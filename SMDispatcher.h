@@ -0,0 +1,111 @@
+// The SMDispatcher module queues state machine events for later execution
+// on a thread of the caller's choosing. The dispatcher adds no threads.
+// Any thread posts events using SM_Post(). The owning thread executes them
+// by calling SM_ProcessPending(), typically from its own event loop.
+//
+// On Linux each dispatcher exposes an eventfd (see SMD_GetFd()) that is
+// readable while events are pending, for use with epoll/poll/select. The fd
+// is written only when the queue becomes non-empty, so a burst of posts
+// costs one wakeup. If SM_ProcessPending() leaves events pending the fd is
+// written again, so the fd may be registered edge-triggered (EPOLLET). On
+// other platforms SMD_GetFd() returns -1 and the caller polls 
+// SM_ProcessPending().
+//
+// Posting to a full queue asserts. Define SMD_DROP_ON_FULL to drop the
+// event instead; SMD_GetDropped() returns the number of events dropped.
+//
+// #include "SMDispatcher.h"
+// SMD_DEFINE(motorDispatcher, 32)
+//
+// SMD_Init(&motorDispatcher);
+// epoll_ctl(epfd, EPOLL_CTL_ADD, SMD_GetFd(&motorDispatcher), &ev);
+//
+// // Any thread
+// SM_Post(&motorDispatcher, Motor1SM, MTR_SetSpeed, data);
+//
+// // Reactor thread, when the fd is readable
+// SM_ProcessPending(&motorDispatcher, 16);
+
+#ifndef _SM_DISPATCHER_H
+#define _SM_DISPATCHER_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include "LockGuard.h"
+
+// Define SMD_LATENCY to record event latency (see SMLatency.h)
+// #define SMD_LATENCY
+#ifdef SMD_LATENCY
+    #include "SMLatency.h"
+#endif
+
+// Define SMD_DROP_ON_FULL to drop events posted to a full queue rather
+// than assert
+// #define SMD_DROP_ON_FULL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A queued event
+typedef struct
+{
+    SM_StateMachine* self;
+    SM_EventFunc eventFunc;
+    void* pEventData;
+#ifdef SMD_LATENCY
+    UINT64 postNs;
+#endif
+} SM_QueuedEvent;
+
+// Use SMD_DEFINE to declare an SM_Dispatcher object
+typedef struct
+{
+    SM_QueuedEvent* events;
+    const UINT32 maxEvents;
+    UINT32 head;
+    UINT32 count;
+    LOCK_HANDLE hLock;
+    int fd;
+    BOOL signalled;
+    UINT32 dropped;
+} SM_Dispatcher;
+
+// Defines a dispatcher with a queue of up to _maxEvents_ pending events
+// e.g. SMD_DEFINE(myDispatcher, 32)
+#define SMD_DEFINE(_name_, _maxEvents_) \
+    static SM_QueuedEvent _name_##Events[_maxEvents_]; \
+    SM_Dispatcher _name_ = { _name_##Events, _maxEvents_, 0, 0, NULL, -1, FALSE, 0 };
+
+#define SMD_DECLARE(_name_) \
+    extern SM_Dispatcher _name_;
+
+// Queue an event to a state machine. Like SM_Event, the dispatcher owns the
+// event data. Asserts if the queue is full, or with SMD_DROP_ON_FULL defined
+// evaluates to FALSE and the data is freed.
+#define SM_Post(_dispatcher_, _smName_, _eventFunc_, _eventData_) \
+    SMD_Post(_dispatcher_, _SM_OBJ(_smName_), (SM_EventFunc)(_eventFunc_), _eventData_)
+
+// Execute up to _max_ pending events. Evaluates to the number executed.
+#define SM_ProcessPending(_dispatcher_, _max_) \
+    SMD_ProcessPending(_dispatcher_, _max_)
+
+void SMD_Init(SM_Dispatcher* self);
+void SMD_Term(SM_Dispatcher* self);
+BOOL SMD_Post(SM_Dispatcher* self, SM_StateMachine* sm, SM_EventFunc eventFunc, void* pEventData);
+UINT32 SMD_ProcessPending(SM_Dispatcher* self, UINT32 max);
+int SMD_GetFd(SM_Dispatcher* self);
+UINT32 SMD_GetDropped(SM_Dispatcher* self);
+
+#ifdef SM_BUDGET
+// Queue the resumption of a yielded state machine. Typically called from 
+// the yield handler of an SM_Budget so a budget-limited instance 
+// continues after the events already pending.
+BOOL SMD_PostResume(SM_Dispatcher* self, SM_StateMachine* sm);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_DISPATCHER_H
@@ -0,0 +1,215 @@
+#include "SMHeatmap.h"
+#include "Atomic.h"
+#include "Fault.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef SM_HEATMAP
+
+// Name of event slot 0
+#define SMHEAT_INTERNAL     "internal"
+
+// Name of event slot SM_HEATMAP_OTHER
+#define SMHEAT_OTHER        "other"
+
+//----------------------------------------------------------------------------
+// SMHEAT_Find
+//----------------------------------------------------------------------------
+static SM_Heatmap* SMHEAT_Find(const CHAR* name)
+{
+    SM_Heatmap* pHeatmap;
+
+    ASSERT_TRUE(name);
+
+    for (pHeatmap = (SM_Heatmap*)ATOMIC_LoadPtr((void* volatile*)&SM_Heatmaps); pHeatmap; pHeatmap = pHeatmap->pNext)
+    {
+        if (strcmp(pHeatmap->name, name) == 0)
+            return pHeatmap;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_StateName
+//----------------------------------------------------------------------------
+static const CHAR* SMHEAT_StateName(const SM_StateMachineConst* pConst, UINT32 state)
+{
+    if (pConst->stateMap)
+        return pConst->stateMap[state].name;
+    return pConst->stateMapEx[state].name;
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_EventName
+//----------------------------------------------------------------------------
+static const CHAR* SMHEAT_EventName(const SM_Heatmap* pHeatmap, UINT32 event)
+{
+    if (event == SM_HEATMAP_OTHER)
+        return SMHEAT_OTHER;
+    if (event == 0 || !pHeatmap->eventNames[event])
+        return SMHEAT_INTERNAL;
+    return pHeatmap->eventNames[event];
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_Count
+//----------------------------------------------------------------------------
+static UINT32 SMHEAT_Count(const SM_Heatmap* pHeatmap, UINT32 event, UINT32 from, UINT32 to)
+{
+    UINT32 maxStates = pHeatmap->pConst->maxStates;
+    return ATOMIC_Load32(&pHeatmap->counts[(event * maxStates + from) * maxStates + to]);
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_MaxCount
+//----------------------------------------------------------------------------
+static UINT32 SMHEAT_MaxCount(const SM_Heatmap* pHeatmap)
+{
+    UINT32 maxStates = pHeatmap->pConst->maxStates;
+    UINT32 total = SM_HEATMAP_EVENTS * maxStates * maxStates;
+    UINT32 maxCount = 0;
+    UINT32 count;
+    UINT32 i;
+
+    for (i = 0; i < total; i++)
+    {
+        count = ATOMIC_Load32(&pHeatmap->counts[i]);
+        if (count > maxCount)
+            maxCount = count;
+    }
+    return maxCount;
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_WriteFile
+//----------------------------------------------------------------------------
+void SMHEAT_WriteFile(const CHAR* text, void* context)
+{
+    ASSERT_TRUE(context);
+    fputs(text, (FILE*)context);
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_ExportDot
+//----------------------------------------------------------------------------
+BOOL SMHEAT_ExportDot(const CHAR* name, SMHEAT_WriteFunc writeFunc, void* context)
+{
+    CHAR line[256];
+    SM_Heatmap* pHeatmap;
+    UINT32 maxStates, maxCount, count;
+    UINT32 event, from, to;
+
+    ASSERT_TRUE(writeFunc);
+
+    pHeatmap = SMHEAT_Find(name);
+    if (!pHeatmap)
+        return FALSE;
+
+    maxStates = pHeatmap->pConst->maxStates;
+    maxCount = SMHEAT_MaxCount(pHeatmap);
+
+    snprintf(line, sizeof(line), "digraph \"%s\" {\n", pHeatmap->name);
+    writeFunc(line, context);
+
+    for (from = 0; from < maxStates; from++)
+    {
+        snprintf(line, sizeof(line), "    \"%s\";\n", SMHEAT_StateName(pHeatmap->pConst, from));
+        writeFunc(line, context);
+    }
+
+    // Edge width scales from 1 to 8 with the transition frequency
+    for (event = 0; event < SM_HEATMAP_EVENTS; event++)
+    {
+        for (from = 0; from < maxStates; from++)
+        {
+            for (to = 0; to < maxStates; to++)
+            {
+                count = SMHEAT_Count(pHeatmap, event, from, to);
+                if (!count)
+                    continue;
+
+                snprintf(line, sizeof(line), "    \"%s\" -> \"%s\" [label=\"%s (%u)\", penwidth=%.2f];\n",
+                    SMHEAT_StateName(pHeatmap->pConst, from), SMHEAT_StateName(pHeatmap->pConst, to),
+                    SMHEAT_EventName(pHeatmap, event), count, 1.0 + 7.0 * count / maxCount);
+                writeFunc(line, context);
+            }
+        }
+    }
+
+    writeFunc("}\n", context);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_ExportJson
+//----------------------------------------------------------------------------
+BOOL SMHEAT_ExportJson(const CHAR* name, SMHEAT_WriteFunc writeFunc, void* context)
+{
+    CHAR line[256];
+    SM_Heatmap* pHeatmap;
+    UINT32 maxStates, count;
+    UINT32 event, from, to;
+    BOOL first = TRUE;
+
+    ASSERT_TRUE(writeFunc);
+
+    pHeatmap = SMHEAT_Find(name);
+    if (!pHeatmap)
+        return FALSE;
+
+    maxStates = pHeatmap->pConst->maxStates;
+
+    snprintf(line, sizeof(line), "{\"machine\":\"%s\",\"states\":[", pHeatmap->name);
+    writeFunc(line, context);
+
+    for (from = 0; from < maxStates; from++)
+    {
+        snprintf(line, sizeof(line), "%s\"%s\"", from ? "," : "", SMHEAT_StateName(pHeatmap->pConst, from));
+        writeFunc(line, context);
+    }
+
+    writeFunc("],\"edges\":[", context);
+
+    for (event = 0; event < SM_HEATMAP_EVENTS; event++)
+    {
+        for (from = 0; from < maxStates; from++)
+        {
+            for (to = 0; to < maxStates; to++)
+            {
+                count = SMHEAT_Count(pHeatmap, event, from, to);
+                if (!count)
+                    continue;
+
+                snprintf(line, sizeof(line), "%s{\"from\":\"%s\",\"to\":\"%s\",\"event\":\"%s\",\"count\":%u}",
+                    first ? "" : ",", SMHEAT_StateName(pHeatmap->pConst, from),
+                    SMHEAT_StateName(pHeatmap->pConst, to), SMHEAT_EventName(pHeatmap, event), count);
+                writeFunc(line, context);
+                first = FALSE;
+            }
+        }
+    }
+
+    writeFunc("]}\n", context);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SMHEAT_Reset
+//----------------------------------------------------------------------------
+void SMHEAT_Reset(void)
+{
+    SM_Heatmap* pHeatmap;
+    UINT32 total;
+    UINT32 i;
+
+    // Event slots stay assigned, only the counts are cleared. Each count is
+    // cleared atomically, as transitions may be counted meanwhile.
+    for (pHeatmap = (SM_Heatmap*)ATOMIC_LoadPtr((void* volatile*)&SM_Heatmaps); pHeatmap; pHeatmap = pHeatmap->pNext)
+    {
+        total = SM_HEATMAP_EVENTS * pHeatmap->pConst->maxStates * pHeatmap->pConst->maxStates;
+        for (i = 0; i < total; i++)
+            ATOMIC_Exchange32(&pHeatmap->counts[i], 0);
+    }
+}
+
+#endif // SM_HEATMAP
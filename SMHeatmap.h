@@ -0,0 +1,42 @@
+// The SMHeatmap module exports the transition counts kept by the state
+// engine when SM_HEATMAP is defined within StateMachine.h. A state machine
+// is written as a Graphviz DOT graph or as JSON, with one edge per
+// (from, to, event) transition weighted by how often it executed.
+// Transitions caused by internal events are labelled "internal", those
+// caused by event functions beyond the SM_HEATMAP_EVENTS slots "other".
+//
+// A state machine appears once it has received its first event.
+//
+// #include "SMHeatmap.h"
+// FILE* fp = fopen("Motor.dot", "w");
+// SMHEAT_ExportDot("Motor", SMHEAT_WriteFile, fp);
+
+#ifndef _SM_HEATMAP_H
+#define _SM_HEATMAP_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef SM_HEATMAP
+
+// Called with each piece of exported text
+typedef void (*SMHEAT_WriteFunc)(const CHAR* text, void* context);
+
+// Write function for a FILE* context
+void SMHEAT_WriteFile(const CHAR* text, void* context);
+
+BOOL SMHEAT_ExportDot(const CHAR* name, SMHEAT_WriteFunc writeFunc, void* context);
+BOOL SMHEAT_ExportJson(const CHAR* name, SMHEAT_WriteFunc writeFunc, void* context);
+void SMHEAT_Reset(void);
+
+#endif // SM_HEATMAP
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_HEATMAP_H
@@ -0,0 +1,332 @@
+#include "SMLatency.h"
+#include "Atomic.h"
+#include "Fault.h"
+#include <string.h>
+#include <time.h>
+
+// Latency histograms of one state machine or event function. The key is 
+// claimed by the first sample recorded for it.
+typedef struct
+{
+    void* volatile key;
+    SMLAT_Histogram wait;
+    SMLAT_Histogram run;
+} SMLAT_Entry;
+
+static SMLAT_Entry _machines[SMLAT_MAX_MACHINES];
+static SMLAT_Entry _events[SMLAT_MAX_EVENTS];
+static volatile UINT32 _dropped = 0;
+static volatile UINT32 _initialized = FALSE;
+
+//----------------------------------------------------------------------------
+// SMLAT_BucketIndex
+//----------------------------------------------------------------------------
+static UINT32 SMLAT_BucketIndex(UINT64 value)
+{
+    UINT32 msb = 0;
+    UINT32 group;
+
+    // Small values are recorded exactly
+    if (value < SMLAT_SUB_BUCKETS)
+        return (UINT32)value;
+
+    if (value >= ((UINT64)1 << SMLAT_MAX_BITS))
+        return SMLAT_BUCKETS - 1;
+
+    while ((value >> msb) > 1)
+        msb++;
+
+    // Each group covers one power of two split into equal sub-buckets
+    group = msb - SMLAT_SUB_BITS + 1;
+    return group * SMLAT_SUB_BUCKETS +
+        (UINT32)((value >> (msb - SMLAT_SUB_BITS)) & (SMLAT_SUB_BUCKETS - 1));
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_BucketMax
+//----------------------------------------------------------------------------
+static UINT64 SMLAT_BucketMax(UINT32 index)
+{
+    UINT32 group = index / SMLAT_SUB_BUCKETS;
+    UINT32 sub = index % SMLAT_SUB_BUCKETS;
+
+    if (group == 0)
+        return sub;
+
+    // The highest value recorded in the bucket
+    return (((UINT64)(SMLAT_SUB_BUCKETS + sub + 1)) << (group - 1)) - 1;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Add
+//----------------------------------------------------------------------------
+static void SMLAT_Add(SMLAT_Histogram* pHist, UINT64 value)
+{
+    UINT64 max;
+
+    ATOMIC_Add64(&pHist->counts[SMLAT_BucketIndex(value)], 1);
+
+    // Raise the maximum unless another thread raised it higher meanwhile
+    max = ATOMIC_Load64(&pHist->max);
+    while (value > max && !ATOMIC_Cas64(&pHist->max, max, value))
+        max = ATOMIC_Load64(&pHist->max);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Snapshot
+//----------------------------------------------------------------------------
+static UINT64 SMLAT_Snapshot(SMLAT_Histogram* pHist, UINT64* counts)
+{
+    UINT64 count = 0;
+    UINT32 index;
+
+    // The count is the sum of the buckets read, so the percentiles agree 
+    // with it while other threads record
+    for (index = 0; index < SMLAT_BUCKETS; index++)
+    {
+        counts[index] = ATOMIC_Load64(&pHist->counts[index]);
+        count += counts[index];
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Percentile
+//----------------------------------------------------------------------------
+static UINT64 SMLAT_Percentile(const UINT64* counts, UINT64 count, UINT64 max, UINT32 perTenThousand)
+{
+    UINT64 target;
+    UINT64 seen = 0;
+    UINT64 value;
+    UINT32 index;
+
+    if (count == 0)
+        return 0;
+
+    // The rank of the sample at the percentile, rounded up
+    target = (count * perTenThousand + 9999) / 10000;
+    if (target == 0)
+        target = 1;
+
+    for (index = 0; index < SMLAT_BUCKETS; index++)
+    {
+        seen += counts[index];
+        if (seen >= target)
+            break;
+    }
+
+    // Report the bucket upper bound, but never above the recorded maximum
+    value = SMLAT_BucketMax(index);
+    return value < max ? value : max;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_GetPercentiles
+//----------------------------------------------------------------------------
+static void SMLAT_GetPercentiles(SMLAT_Histogram* pHist, SMLAT_Percentiles* pPercentiles)
+{
+    UINT64 counts[SMLAT_BUCKETS];
+
+    pPercentiles->count = SMLAT_Snapshot(pHist, counts);
+    pPercentiles->max = ATOMIC_Load64(&pHist->max);
+    pPercentiles->p50 = SMLAT_Percentile(counts, pPercentiles->count, pPercentiles->max, 5000);
+    pPercentiles->p99 = SMLAT_Percentile(counts, pPercentiles->count, pPercentiles->max, 9900);
+    pPercentiles->p999 = SMLAT_Percentile(counts, pPercentiles->count, pPercentiles->max, 9990);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Find
+//----------------------------------------------------------------------------
+static SMLAT_Entry* SMLAT_Find(SMLAT_Entry* entries, UINT32 maxEntries, void* key, BOOL create)
+{
+    UINT32 start;
+    UINT32 index;
+    UINT32 i;
+    void* current;
+
+    // Start from a hash of the key and probe onwards, so a lookup usually
+    // reads a single entry
+    start = (UINT32)(((size_t)key >> 4) * 2654435761u) % maxEntries;
+
+    for (i = 0; i < maxEntries; i++)
+    {
+        index = (start + i) % maxEntries;
+        current = ATOMIC_LoadPtr(&entries[index].key);
+        if (current == key)
+            return &entries[index];
+
+        if (!current)
+        {
+            if (!create)
+                return NULL;
+
+            // Claim the free entry, unless another thread claimed it first
+            // for the same key
+            if (ATOMIC_CasPtr(&entries[index].key, NULL, key) || 
+                ATOMIC_LoadPtr(&entries[index].key) == key)
+                return &entries[index];
+        }
+    }
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Init
+//----------------------------------------------------------------------------
+void SMLAT_Init(void)
+{
+    ASSERT_TRUE(!SMLAT_IsInitialized());
+    ATOMIC_Exchange32(&_initialized, TRUE);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Term
+//----------------------------------------------------------------------------
+void SMLAT_Term(void)
+{
+    ASSERT_TRUE(SMLAT_IsInitialized());
+
+    // No dispatcher is recording, so the entries are released as well
+    memset((void*)_machines, 0, sizeof(_machines));
+    memset((void*)_events, 0, sizeof(_events));
+    _dropped = 0;
+
+    ATOMIC_Exchange32(&_initialized, FALSE);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_IsInitialized
+//----------------------------------------------------------------------------
+BOOL SMLAT_IsInitialized(void)
+{
+    return ATOMIC_Load32(&_initialized) != FALSE;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_ResetEntries
+//----------------------------------------------------------------------------
+static void SMLAT_ResetEntries(SMLAT_Entry* entries, UINT32 maxEntries)
+{
+    UINT32 i;
+    UINT32 index;
+
+    // Each entry keeps its key, since a recording thread may already have 
+    // found it
+    for (i = 0; i < maxEntries; i++)
+    {
+        for (index = 0; index < SMLAT_BUCKETS; index++)
+        {
+            ATOMIC_StoreRelaxed64(&entries[i].wait.counts[index], 0);
+            ATOMIC_StoreRelaxed64(&entries[i].run.counts[index], 0);
+        }
+        ATOMIC_StoreRelaxed64(&entries[i].wait.max, 0);
+        ATOMIC_StoreRelaxed64(&entries[i].run.max, 0);
+    }
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Reset
+//----------------------------------------------------------------------------
+void SMLAT_Reset(void)
+{
+    ASSERT_TRUE(SMLAT_IsInitialized());
+
+    SMLAT_ResetEntries(_machines, SMLAT_MAX_MACHINES);
+    SMLAT_ResetEntries(_events, SMLAT_MAX_EVENTS);
+    ATOMIC_Exchange32(&_dropped, 0);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_NowNs
+//----------------------------------------------------------------------------
+UINT64 SMLAT_NowNs(void)
+{
+    struct timespec ts;
+
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (UINT64)ts.tv_sec * 1000000000 + (UINT64)ts.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_Record
+//----------------------------------------------------------------------------
+void SMLAT_Record(SM_StateMachine* sm, SM_EventFunc eventFunc, UINT64 waitNs, UINT64 runNs)
+{
+    SMLAT_Entry* pEntry;
+
+    ASSERT_TRUE(sm);
+    ASSERT_TRUE(eventFunc);
+
+    // Ensure SMLAT_Init() was called
+    ASSERT_TRUE(SMLAT_IsInitialized());
+
+    pEntry = SMLAT_Find(_machines, SMLAT_MAX_MACHINES, (void*)sm, TRUE);
+    if (pEntry)
+    {
+        SMLAT_Add(&pEntry->wait, waitNs);
+        SMLAT_Add(&pEntry->run, runNs);
+    }
+    else
+        ATOMIC_FetchAdd32(&_dropped, 1);
+
+    pEntry = SMLAT_Find(_events, SMLAT_MAX_EVENTS, (void*)eventFunc, TRUE);
+    if (pEntry)
+    {
+        SMLAT_Add(&pEntry->wait, waitNs);
+        SMLAT_Add(&pEntry->run, runNs);
+    }
+    else
+        ATOMIC_FetchAdd32(&_dropped, 1);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_GetStats
+//----------------------------------------------------------------------------
+static BOOL SMLAT_GetStats(SMLAT_Entry* entries, UINT32 maxEntries, void* key, SMLAT_Stats* pStats)
+{
+    SMLAT_Entry* pEntry;
+
+    ASSERT_TRUE(pStats);
+    ASSERT_TRUE(SMLAT_IsInitialized());
+
+    pEntry = SMLAT_Find(entries, maxEntries, key, FALSE);
+    if (pEntry)
+    {
+        SMLAT_GetPercentiles(&pEntry->wait, &pStats->wait);
+        SMLAT_GetPercentiles(&pEntry->run, &pStats->run);
+    }
+
+    return pEntry != NULL;
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_GetMachineStats
+//----------------------------------------------------------------------------
+BOOL SMLAT_GetMachineStats(SM_StateMachine* sm, SMLAT_Stats* pStats)
+{
+    ASSERT_TRUE(sm);
+    return SMLAT_GetStats(_machines, SMLAT_MAX_MACHINES, (void*)sm, pStats);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_GetEventStats
+//----------------------------------------------------------------------------
+BOOL SMLAT_GetEventStats(SM_EventFunc eventFunc, SMLAT_Stats* pStats)
+{
+    ASSERT_TRUE(eventFunc);
+    return SMLAT_GetStats(_events, SMLAT_MAX_EVENTS, (void*)eventFunc, pStats);
+}
+
+//----------------------------------------------------------------------------
+// SMLAT_GetDropped
+//----------------------------------------------------------------------------
+UINT32 SMLAT_GetDropped(void)
+{
+    ASSERT_TRUE(SMLAT_IsInitialized());
+    return ATOMIC_Load32(&_dropped);
+}
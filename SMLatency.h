@@ -0,0 +1,81 @@
+// The SMLatency module records the latency of events executed by an
+// SMDispatcher. Each event records the time waiting in the queue, from
+// SM_Post() to the start of execution, and the time executing the event
+// and the states it caused to run. Times are kept in log-linear histograms
+// per state machine and per event function, reported as percentiles. 
+// Recording takes no lock; each sample increments its buckets atomically,
+// so dispatchers on different threads never wait for one another.
+//
+// Define SMD_LATENCY within SMDispatcher.h to enable recording, then call
+// SMLAT_Init() once at startup, before SMD_Init(). SMLAT_Reset() clears the
+// samples recorded so far, while each state machine and event function 
+// keeps its entry. SMLAT_Term() releases the module once no dispatcher is
+// recording.
+//
+// SMLAT_Stats stats;
+// if (SMLAT_GetMachineStats(SM_GetObj(Motor1SM), &stats))
+//     printf("p99 wait %llu ns\n", stats.wait.p99);
+
+#ifndef _SM_LATENCY_H
+#define _SM_LATENCY_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of state machines and event functions recorded separately.
+// Samples for any more are counted as dropped.
+#define SMLAT_MAX_MACHINES      8
+#define SMLAT_MAX_EVENTS        16
+
+// Each power of two is split into 2^SMLAT_SUB_BITS buckets, so a recorded
+// value is within 1/2^SMLAT_SUB_BITS (12.5%) of the actual value
+#define SMLAT_SUB_BITS          3
+
+// Values of 2^SMLAT_MAX_BITS ns (about 18 minutes) or more are recorded
+// in the last bucket
+#define SMLAT_MAX_BITS          40
+
+#define SMLAT_SUB_BUCKETS       (1 << SMLAT_SUB_BITS)
+#define SMLAT_BUCKETS           ((SMLAT_MAX_BITS - SMLAT_SUB_BITS + 1) * SMLAT_SUB_BUCKETS)
+
+typedef struct
+{
+    volatile UINT64 counts[SMLAT_BUCKETS];
+    volatile UINT64 max;
+} SMLAT_Histogram;
+
+// Latency percentiles in nanoseconds
+typedef struct
+{
+    UINT64 count;
+    UINT64 p50;
+    UINT64 p99;
+    UINT64 p999;
+    UINT64 max;
+} SMLAT_Percentiles;
+
+typedef struct
+{
+    SMLAT_Percentiles wait;
+    SMLAT_Percentiles run;
+} SMLAT_Stats;
+
+void SMLAT_Init(void);
+void SMLAT_Term(void);
+BOOL SMLAT_IsInitialized(void);
+void SMLAT_Reset(void);
+UINT64 SMLAT_NowNs(void);
+void SMLAT_Record(SM_StateMachine* sm, SM_EventFunc eventFunc, UINT64 waitNs, UINT64 runNs);
+BOOL SMLAT_GetMachineStats(SM_StateMachine* sm, SMLAT_Stats* pStats);
+BOOL SMLAT_GetEventStats(SM_EventFunc eventFunc, SMLAT_Stats* pStats);
+UINT32 SMLAT_GetDropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_LATENCY_H
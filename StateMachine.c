@@ -1,57 +1,842 @@
 #include "Fault.h"
 #include "StateMachine.h"
+#include "Atomic.h"
+#ifdef SM_BUDGET
+    #include <time.h>
+#endif
+#ifdef SM_REGIONS
+    #include <string.h>
+#endif
 
 // @see https://github.com/endurodave/C_StateMachine
 
+#if defined(SM_COUNTERS) || defined(SM_REGIONS) || defined(SM_SEQLOCK)
+    #if defined(_MSC_VER)
+        #define SM_THREAD_LOCAL  __declspec(thread)
+    #else
+        #define SM_THREAD_LOCAL  __thread
+    #endif
+#endif
+
+#ifdef SM_REGIONS
+// Event data shared by the regions receiving the current event
+static SM_THREAD_LOCAL void* _sharedData = NULL;
+
+// Frees event data unless it is shared by orthogonal regions
+#define SM_FREE_EVENT_DATA(_pEventData_) \
+    do { \
+        if ((_pEventData_) != _sharedData) \
+            SM_XFree(_pEventData_); \
+    } while (0)
+
+#ifdef SM_LOCK
+// Region events holding their region locks on the calling thread, innermost
+// first
+static SM_THREAD_LOCAL SM_RegionEvent* _pRegionEvents = NULL;
+
+// Returns TRUE if a region event on the calling thread holds hLock
+BOOL _SM_RegionLockHeld(LOCK_HANDLE hLock)
+{
+    SM_RegionEvent* pEvent;
+    UINT32 i;
+
+    for (pEvent = _pRegionEvents; pEvent; pEvent = pEvent->pPrev)
+    {
+        for (i = 0; i < pEvent->numLocks; i++)
+        {
+            if (pEvent->locks[i] == hLock)
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Acquires the distinct region locks not already held by the calling 
+// thread, in address order
+static void SM_LockRegions(SM_RegionEvent* pEvent)
+{
+    LOCK_HANDLE hLock;
+    UINT32 i, j;
+
+    pEvent->numLocks = 0;
+    for (i = 0; i < pEvent->count; i++)
+    {
+        hLock = _SM_COLD(pEvent->regions[i])->hLock;
+        if (!hLock || _SM_RegionLockHeld(hLock))
+            continue;
+
+        // Insertion sort, skipping a lock shared by several regions
+        for (j = pEvent->numLocks; j > 0 && (BYTE*)pEvent->locks[j - 1] > (BYTE*)hLock; j--)
+            ;
+        if (j > 0 && pEvent->locks[j - 1] == hLock)
+            continue;
+        memmove(&pEvent->locks[j + 1], &pEvent->locks[j], (pEvent->numLocks - j) * sizeof(LOCK_HANDLE));
+        pEvent->locks[j] = hLock;
+        pEvent->numLocks++;
+    }
+
+    for (i = 0; i < pEvent->numLocks; i++)
+        LK_LOCK(pEvent->locks[i]);
+
+    pEvent->pPrev = _pRegionEvents;
+    _pRegionEvents = pEvent;
+}
+
+// Releases the locks acquired by SM_LockRegions
+static void SM_UnlockRegions(SM_RegionEvent* pEvent)
+{
+    UINT32 i;
+
+    _pRegionEvents = pEvent->pPrev;
+
+    for (i = pEvent->numLocks; i > 0; i--)
+        LK_UNLOCK(pEvent->locks[i - 1]);
+}
+#endif
+
+// Adds a region to receive a region event
+void _SM_AddRegion(SM_RegionEvent* pEvent, SM_StateMachine* self, SM_EventFunc eventFunc)
+{
+    ASSERT_TRUE(pEvent);
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(eventFunc);
+
+    // Increase SM_MAX_REGIONS
+    ASSERT_TRUE(pEvent->count < SM_MAX_REGIONS);
+
+    pEvent->regions[pEvent->count] = self;
+    pEvent->eventFuncs[pEvent->count] = eventFunc;
+    pEvent->count++;
+}
+
+// Generates one event to every region of a region event, sharing the event
+// data, then frees the event data
+void _SM_RegionEvent(SM_RegionEvent* pEvent, void* pEventData)
+{
+    void* pPrevShared;
+    UINT32 i;
+
+    ASSERT_TRUE(pEvent);
+
+#ifdef SM_LOCK
+    SM_LockRegions(pEvent);
+#endif
+
+    // The regions neither copy nor free the shared event data
+    pPrevShared = _sharedData;
+    _sharedData = pEventData;
+
+    for (i = 0; i < pEvent->count; i++)
+        pEvent->eventFuncs[i](pEvent->regions[i], pEventData);
+
+    _sharedData = pPrevShared;
+
+#ifdef SM_LOCK
+    SM_UnlockRegions(pEvent);
+#endif
+
+    if (pEventData)
+        SM_XFree(pEventData);
+}
+#else
+#define SM_FREE_EVENT_DATA(_pEventData_) \
+    SM_XFree(_pEventData_)
+#endif
+
+#ifdef SM_COMPACT
+static SM_StateMachineCold _defaultColdTable[SM_COMPACT_DEFAULT_INSTANCES];
+
+// The cold side table shared by all compact instances
+SM_StateMachineCold* SM_ColdTable = _defaultColdTable;
+static UINT32 _maxColdInstances = SM_COMPACT_DEFAULT_INSTANCES;
+static volatile UINT32 _nextColdIndex = 0;
+
+// Set the cold side table used by all compact instances. Any instances
+// already bound are copied into the new table. Call once at startup before
+// creating instances.
+void SM_CompactInit(SM_StateMachineCold* coldTable, UINT32 maxInstances)
+{
+    UINT32 i;
+
+    ASSERT_TRUE(coldTable);
+    ASSERT_TRUE(maxInstances >= _nextColdIndex);
+
+    for (i = 0; i < _nextColdIndex; i++)
+        coldTable[i] = SM_ColdTable[i];
+
+    SM_ColdTable = coldTable;
+    _maxColdInstances = maxInstances;
+}
+
+// Claims and initializes the next cold table entry. Returns its index.
+static UINT32 SM_ColdCreate(const CHAR* name, void* pInstance)
+{
+    SM_StateMachineCold* cold;
+    UINT32 index;
+
+    index = ATOMIC_FetchAdd32(&_nextColdIndex, 1);
+    ASSERT_TRUE(index < _maxColdInstances);
+
+    cold = &SM_ColdTable[index];
+    cold->name = name;
+    cold->pInstance = pInstance;
+    cold->pEventData = NULL;
+    cold->pArena = NULL;
+    cold->observer = NULL;
+#ifdef SM_SEQLOCK
+    cold->seq = 0;
+#endif
+#ifdef SM_BUDGET
+    cold->pBudget = NULL;
+    cold->pYieldConst = NULL;
+#endif
+#ifdef SM_HEATMAP
+    cold->heatEvent = 0;
+#endif
+#ifdef SM_LOCK
+    cold->hLock = NULL;
+#endif
+#ifdef SM_DEFER
+    cold->pDeferQueue = NULL;
+#endif
+
+    return index;
+}
+
+// Initialize a compact instance and assign it the next cold table entry.
+// Returns the instance index.
+UINT32 SM_CompactCreate(SM_StateMachine* self, const CHAR* name, void* pInstance)
+{
+    UINT32 index;
+
+    C_ASSERT(sizeof(SM_StateMachine) == 8);
+    ASSERT_TRUE(self);
+
+    self->newState = 0;
+    self->currentState = 0;
+    self->flags = 0;
+    self->reserved = 0;
+
+    index = SM_ColdCreate(name, pInstance);
+    ATOMIC_Exchange32((volatile UINT32*)&self->instanceIndex, index);
+    return index;
+}
+
+// Binds a statically defined instance to a cold table entry on first use.
+// Threads racing to bind the same instance agree on a single entry: the 
+// winner of the compare-and-swap creates it while the others wait.
+SM_StateMachine* _SM_Bind(SM_StateMachine* self, const SM_StateMachineCold* cold)
+{
+    volatile UINT32* pIndex = (volatile UINT32*)&self->instanceIndex;
+
+    if (ATOMIC_Load32(pIndex) < SM_INDEX_BINDING)
+        return self;
+
+    if (ATOMIC_Cas32(pIndex, SM_INDEX_UNBOUND, SM_INDEX_BINDING))
+        ATOMIC_Exchange32(pIndex, SM_ColdCreate(cold->name, cold->pInstance));
+    else
+    {
+        // Another thread is binding the instance
+        while (ATOMIC_Load32(pIndex) >= SM_INDEX_BINDING)
+            ;
+    }
+    return self;
+}
+#endif
+
+// Sets the function called by the state engine after every state function 
+// of the instance executes. Asserts if the instance has another observer.
+void _SM_SetObserver(SM_StateMachine* self, SM_ObserverFunc observer)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(!observer || !_SM_COLD(self)->observer || _SM_COLD(self)->observer == observer);
+    _SM_COLD(self)->observer = observer;
+}
+
+// Locks the instance as its events do, so another module may read it while
+// events are generated on other threads. Does nothing unless SM_LOCK is 
+// defined and the instance has a lock.
+void _SM_LockInstance(SM_StateMachine* self)
+{
+    ASSERT_TRUE(self);
+    _SM_LOCK(self);
+}
+
+// Unlocks an instance locked using _SM_LockInstance
+void _SM_UnlockInstance(SM_StateMachine* self)
+{
+    ASSERT_TRUE(self);
+    _SM_UNLOCK(self);
+}
+
+#ifdef SM_BUDGET
+// Gets a consistent snapshot of the budget statistics. The counters are 
+// collected until two passes agree, so the three values coexisted even 
+// while instances sharing the budget run on other threads.
+void SM_GetBudgetStats(const SM_Budget* pBudget, SM_BudgetStats* pStats)
+{
+    SM_Budget* pShared = (SM_Budget*)pBudget;
+    SM_BudgetStats check;
+
+    ASSERT_TRUE(pBudget);
+    ASSERT_TRUE(pStats);
+
+    check.yields = ATOMIC_Load32(&pShared->yields);
+    check.resumes = ATOMIC_Load32(&pShared->resumes);
+    check.forced = ATOMIC_Load32(&pShared->forced);
+    do
+    {
+        *pStats = check;
+        check.yields = ATOMIC_Load32(&pShared->yields);
+        check.resumes = ATOMIC_Load32(&pShared->resumes);
+        check.forced = ATOMIC_Load32(&pShared->forced);
+    } while (check.yields != pStats->yields || check.resumes != pStats->resumes ||
+        check.forced != pStats->forced);
+}
+
+// Returns a monotonic time in microseconds
+static UINT64 SM_NowUs(void)
+{
+    struct timespec ts;
+
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (UINT64)ts.tv_sec * 1000000 + (UINT64)ts.tv_nsec / 1000;
+}
+
+// Start time of a dispatch, only read if a time budget is set
+#define SM_BUDGET_START(_pBudget_) \
+    (((_pBudget_) && (_pBudget_)->maxUs) ? SM_NowUs() : 0)
+
+// Returns TRUE once a dispatch has spent its budget
+static BOOL SM_BudgetSpent(const SM_Budget* pBudget, UINT32 transitions, UINT64 startUs)
+{
+    if (!pBudget)
+        return FALSE;
+    if (pBudget->maxTransitions && transitions >= pBudget->maxTransitions)
+        return TRUE;
+    if (pBudget->maxUs && SM_NowUs() - startUs >= pBudget->maxUs)
+        return TRUE;
+    return FALSE;
+}
+
+// Holds the pending internal event of an instance until resumed
+static void SM_Yield(SM_StateMachine* self, const SM_StateMachineConst* selfConst)
+{
+    SM_Budget* pBudget = _SM_COLD(self)->pBudget;
+
+#ifdef SM_REGIONS
+    // Shared region event data is freed before the instance resumes
+    ASSERT_TRUE(_SM_COLD(self)->pEventData == NULL || _SM_COLD(self)->pEventData != _sharedData);
+#endif
+
+    _SM_COLD(self)->pYieldConst = selfConst;
+    ATOMIC_FetchAdd32(&pBudget->yields, 1);
+
+    if (pBudget->yieldHandler)
+        pBudget->yieldHandler(self);
+}
+#endif
+
+#ifdef SM_COUNTERS
+// Registered counter sets, most recently registered first
+SM_CounterSet* volatile SM_CounterSets = NULL;
+
+// Counter shard index + 1 of the calling thread, assigned on first use
+static SM_THREAD_LOCAL UINT32 _shard = 0;
+static volatile UINT32 _nextShard = 0;
+
+// Shard index + 1 shared by the threads beyond the first SM_COUNTER_SHARDS - 1
+#define SM_SHARED_SHARD     SM_COUNTER_SHARDS
+
+// Increments a counter of the calling thread's shard
+#define SM_COUNT(_pCounters_, _field_) \
+    SM_Count(&(_pCounters_)->_field_)
+
+// Increments a shard counter. An owned shard has a single writer, so the
+// increment needs no locked instruction, only a store readers see whole.
+static __inline void SM_Count(volatile UINT64* pCounter)
+{
+    if (_shard == SM_SHARED_SHARD)
+        ATOMIC_Add64(pCounter, 1);
+    else
+        ATOMIC_StoreRelaxed64(pCounter, *pCounter + 1);
+}
+
+// Returns the calling thread's counter shard of a state machine
+static SM_Counters* SM_GetCounters(const SM_StateMachineConst* selfConst)
+{
+    SM_CounterSet* pSet = selfConst->pCounters;
+    SM_CounterSet* pHead;
+    UINT32 shard;
+
+    if (!_shard)
+    {
+        shard = ATOMIC_FetchAdd32(&_nextShard, 1) + 1;
+        _shard = shard < SM_SHARED_SHARD ? shard : SM_SHARED_SHARD;
+    }
+
+    // Add the counter set to the list for export on first use
+    if (!pSet->registered && ATOMIC_Cas32(&pSet->registered, 0, 1))
+    {
+        do
+        {
+            pHead = (SM_CounterSet*)ATOMIC_LoadPtr((void* volatile*)&SM_CounterSets);
+            pSet->pNext = pHead;
+        } while (!ATOMIC_CasPtr((void* volatile*)&SM_CounterSets, pHead, pSet));
+    }
+
+    return &pSet->shards[_shard - 1].counters;
+}
+
+// Passes the counter shard of the calling thread to SM_Dispatch
+#define SM_COUNTERS_ARG \
+    , pCounters
+#define SM_COUNTERS_LOOKUP(_selfConst_) \
+    , SM_GetCounters(_selfConst_)
+#else
+#define SM_COUNTERS_ARG
+#define SM_COUNTERS_LOOKUP(_selfConst_)
+#endif
+
+#ifdef SM_HEATMAP
+// Registered heatmaps, most recently registered first
+SM_Heatmap* volatile SM_Heatmaps = NULL;
+
+// Counts one transition of an instance caused by event slot _event_. 
+// Instances on other threads count into the same matrix.
+#define SM_HEAT_COUNT(_self_, _selfConst_, _event_) \
+    ATOMIC_FetchAdd32(&(_selfConst_)->pHeatmap->counts[((_event_) * (_selfConst_)->maxStates + \
+        (_self_)->currentState) * (_selfConst_)->maxStates + (_self_)->newState], 1)
+
+// Event slot of an event function being assigned by another thread
+#define SM_HEAT_CLAIMING    0xFFFFFFFF
+
+// Records the event function generating an external event. Called once per
+// external event. An event function is assigned a heatmap slot on first use.
+// Threads racing to assign the same event function agree on a single slot:
+// the winner of the compare-and-swap assigns it while the others wait.
+void _SM_HeatEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, volatile UINT32* pEventIndex, const CHAR* eventName)
+{
+    SM_Heatmap* pHeatmap = selfConst->pHeatmap;
+    SM_Heatmap* pHead;
+    UINT32 index;
+
+    ASSERT_TRUE(self);
+
+    index = ATOMIC_Load32(pEventIndex);
+    if (index == 0 && ATOMIC_Cas32(pEventIndex, 0, SM_HEAT_CLAIMING))
+    {
+        // Add the heatmap to the list for export on first use
+        if (!pHeatmap->registered && ATOMIC_Cas32(&pHeatmap->registered, 0, 1))
+        {
+            pHeatmap->pConst = selfConst;
+            do
+            {
+                pHead = (SM_Heatmap*)ATOMIC_LoadPtr((void* volatile*)&SM_Heatmaps);
+                pHeatmap->pNext = pHead;
+            } while (!ATOMIC_CasPtr((void* volatile*)&SM_Heatmaps, pHead, pHeatmap));
+        }
+
+        // Slot 0 is reserved for internal events. Once the named slots are
+        // used up, further event functions share the last slot.
+        index = ATOMIC_FetchAdd32(&pHeatmap->numEvents, 1) + 1;
+        if (index < SM_HEATMAP_OTHER)
+            pHeatmap->eventNames[index] = eventName;
+        else
+            index = SM_HEATMAP_OTHER;
+        ATOMIC_Exchange32(pEventIndex, index);
+    }
+    else
+    {
+        // Another thread may be assigning the slot
+        while (index == 0 || index == SM_HEAT_CLAIMING)
+            index = ATOMIC_Load32(pEventIndex);
+    }
+
+    _SM_COLD(self)->heatEvent = (BYTE)index;
+}
+#endif
+
+// Scratch arena allocations are aligned to the largest fundamental type
+#define SM_ARENA_ALIGN  sizeof(UINT64)
+
+// Releases all scratch arena allocations of an instance
+#define SM_ARENA_RESET(_self_) \
+    do { \
+        SM_Arena* _pArena_ = _SM_COLD(_self_)->pArena; \
+        if (_pArena_) \
+            _pArena_->used = 0; \
+    } while (0)
+
+// Bump allocates size bytes from the instance scratch arena. The memory
+// is valid until the instance leaves the current state.
+void* _SM_ArenaAlloc(SM_StateMachine* self, size_t size)
+{
+    SM_Arena* pArena;
+    size_t start;
+
+    ASSERT_TRUE(self);
+
+    // Ensure SM_SetArena() was called on the instance
+    pArena = _SM_COLD(self)->pArena;
+    ASSERT_TRUE(pArena);
+
+    // Align the next allocation on the address, not the offset
+    start = (size_t)(pArena->pBuffer + pArena->used);
+    start = ((start + SM_ARENA_ALIGN - 1) & ~(SM_ARENA_ALIGN - 1)) - (size_t)pArena->pBuffer;
+
+    if (start > pArena->size || size > pArena->size - start)
+    {
+        // Scratch arena exhausted
+        ASSERT();
+        return NULL;
+    }
+
+    pArena->used = start + size;
+    return pArena->pBuffer + start;
+}
+
+// Releases all scratch arena allocations of an instance before it leaves
+// the current state
+void _SM_ArenaReset(SM_StateMachine* self)
+{
+    ASSERT_TRUE(self);
+    SM_ARENA_RESET(self);
+}
+
+#ifdef SM_SEQLOCK
+// An instance whose events are executing on the calling thread
+typedef struct SM_Dispatching
+{
+    SM_StateMachine* self;
+    struct SM_Dispatching* pPrev;
+} SM_Dispatching;
+
+// Instances dispatching on the calling thread, innermost first
+static SM_THREAD_LOCAL SM_Dispatching* _pDispatching = NULL;
+
+// Starts a consistent read of an instance. Returns the sequence number to
+// pass to _SM_ReadRetry() once the read is done.
+UINT32 _SM_ReadBegin(SM_StateMachine* self)
+{
+    SM_Dispatching* pDispatching;
+    UINT32 seq;
+
+    ASSERT_TRUE(self);
+
+    // The sequence stays odd until the event completes, so a read of an 
+    // instance dispatching on this thread would retry forever
+    for (pDispatching = _pDispatching; pDispatching; pDispatching = pDispatching->pPrev)
+        ASSERT_TRUE(pDispatching->self != self);
+
+    seq = ATOMIC_Load32(&_SM_COLD(self)->seq);
+    ATOMIC_Fence();
+    return seq;
+}
+
+// Returns TRUE if an event executed during the read, in which case the 
+// values read may be inconsistent and the read must be repeated
+BOOL _SM_ReadRetry(SM_StateMachine* self, UINT32 seq)
+{
+    ASSERT_TRUE(self);
+
+    ATOMIC_Fence();
+    return (seq & 1) || ATOMIC_Load32(&_SM_COLD(self)->seq) != seq;
+}
+#endif
+
+// Executes the pending internal event and any events it generates
+static void SM_Dispatch(SM_StateMachine* self, const SM_StateMachineConst* selfConst _SM_COUNTERS_PARAM)
+{
+#ifdef SM_SEQLOCK
+    SM_Dispatching dispatching;
+
+    dispatching.self = self;
+    dispatching.pPrev = _pDispatching;
+    _pDispatching = &dispatching;
+
+    // An odd sequence tells readers the instance is changing
+    ATOMIC_FetchAdd32(&_SM_COLD(self)->seq, 1);
+    ATOMIC_Fence();
+#endif
+
+    // Execute state machine based on type of state map defined
+    if (selfConst->stateMap)
+        _SM_StateEngine(self, selfConst SM_COUNTERS_ARG);
+    else
+        _SM_StateEngineEx(self, selfConst SM_COUNTERS_ARG);
+
+#ifdef SM_SEQLOCK
+    // Publish the completed transitions to readers
+    ATOMIC_FetchAdd32(&_SM_COLD(self)->seq, 1);
+    _pDispatching = dispatching.pPrev;
+#endif
+}
+
 // Generates an external event. Called once per external event 
 // to start the state machine executing
 void _SM_ExternalEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, BYTE newState, void* pEventData)
 {
+#ifdef SM_COUNTERS
+    SM_Counters* pCounters = SM_GetCounters(selfConst);
+    SM_COUNT(pCounters, eventsReceived);
+#endif
+
     // If we are supposed to ignore this event
     if (newState == EVENT_IGNORED) 
     {
+#ifdef SM_COUNTERS
+        SM_COUNT(pCounters, eventsIgnored);
+#endif
+#ifdef SM_HEATMAP
+        // No transition to attribute the event to
+        _SM_COLD(self)->heatEvent = 0;
+#endif
+
         // Just delete the event data, if any
         if (pEventData)
-            SM_XFree(pEventData);
+            SM_FREE_EVENT_DATA(pEventData);
     }
     else 
     {
-        // TODO - capture software lock here for thread-safety if necessary
+        // The instance lock, if any, is held by the caller. See SM_LOCK.
 
         // Generate the event 
         _SM_InternalEvent(self, newState, pEventData);
 
-        // Execute state machine based on type of state map defined
-        if (selfConst->stateMap)
-            _SM_StateEngine(self, selfConst);
-        else
-            _SM_StateEngineEx(self, selfConst);
+        // Execute the state machine
+        SM_Dispatch(self, selfConst SM_COUNTERS_ARG);
+    }
+}
+
+#ifdef SM_DEFER
+// Generates again, in order, each deferred event no longer deferred in the 
+// current state. The earlier events are checked again only once the state 
+// changes, and the generated events are removed in one pass at the end. If 
+// complete is TRUE, transitions yielded under SM_BUDGET are completed so the
+// caller may generate another event.
+static void SM_Redispatch(SM_StateMachine* self, const SM_StateMachineConst* selfConst, BOOL complete)
+{
+    SM_DeferQueue* pQueue = _SM_COLD(self)->pDeferQueue;
+    SM_Deferred deferred;
+    BYTE newState;
+    BYTE state;
+    UINT32 i = 0;
+    UINT32 kept = 0;
+
+#ifndef SM_BUDGET
+    (void)complete;
+#endif
+
+    // An event generated by a state function while the queue is scanned. 
+    // The scan in progress checks the queue again if the state changes.
+    if (pQueue->busy)
+        return;
+    pQueue->busy = TRUE;
+
+    pQueue->stale = FALSE;
+
+    while (i < pQueue->count)
+    {
+#ifdef SM_BUDGET
+        // A yielded instance must complete its transitions first
+        if (_SM_COLD(self)->pYieldConst)
+        {
+            if (!complete)
+            {
+                // Checked again before the next external event
+                pQueue->stale = TRUE;
+                break;
+            }
+            _SM_CompleteYielded(self);
+            i = 0;
+            continue;
+        }
+#endif
+        // Skip events already generated
+        if (!pQueue->events[i].transitions)
+        {
+            i++;
+            continue;
+        }
 
-        // TODO - release software lock here 
+        newState = pQueue->events[i].transitions[self->currentState];
+        if (newState == EVENT_DEFERRED)
+        {
+            i++;
+            continue;
+        }
+
+        // Mark the event generated, it is removed once the scan ends
+        deferred = pQueue->events[i];
+        pQueue->events[i].transitions = NULL;
+
+#ifdef SM_HEATMAP
+        _SM_COLD(self)->heatEvent = deferred.heatEvent;
+#endif
+        state = self->currentState;
+        _SM_ExternalEvent(self, selfConst, newState, deferred.pEventData);
+
+        // The earlier events stay deferred unless the state changed
+        i = (self->currentState != state) ? 0 : i + 1;
     }
+
+    // Remove the generated events, keeping the order of the remaining events
+    for (i = 0; i < pQueue->count; i++)
+    {
+        if (pQueue->events[i].transitions)
+            pQueue->events[kept++] = pQueue->events[i];
+    }
+    pQueue->count = kept;
+    pQueue->busy = FALSE;
 }
 
+// Generates an external event that may be deferred in the current state. 
+// Called once per external event in place of _SM_ExternalEvent.
+void _SM_DeferrableEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, const BYTE* transitions, void* pEventData)
+{
+    SM_DeferQueue* pQueue;
+    SM_Deferred* pDeferred;
+#if defined(SM_BUDGET) && defined(SM_HEATMAP)
+    BYTE heatEvent;
+#endif
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(transitions);
+
+    pQueue = _SM_COLD(self)->pDeferQueue;
+
+#ifdef SM_BUDGET
+    // Deferred events left unchecked by a yielded dispatch go before this event
+    if (pQueue && pQueue->stale)
+    {
+#ifdef SM_HEATMAP
+        // Keep this event's heatmap slot, the redispatch overwrites it
+        heatEvent = _SM_COLD(self)->heatEvent;
+#endif
+        SM_Redispatch(self, selfConst, TRUE);
+#ifdef SM_HEATMAP
+        _SM_COLD(self)->heatEvent = heatEvent;
+#endif
+    }
+#endif
+
+    if (transitions[self->currentState] == EVENT_DEFERRED)
+    {
+        // Ensure SM_SetDeferQueue() was called on the instance
+        ASSERT_TRUE(pQueue);
+
+        // Deferral queue full
+        ASSERT_TRUE(pQueue->count < pQueue->maxEvents);
+
+#ifdef SM_REGIONS
+        // Shared region event data is freed once the regions return
+        ASSERT_TRUE(pEventData == NULL || pEventData != _sharedData);
+#endif
+
+        // Keep the event data pointer, the data itself is not copied
+        pDeferred = &pQueue->events[pQueue->count++];
+        pDeferred->transitions = transitions;
+        pDeferred->pEventData = pEventData;
+#ifdef SM_HEATMAP
+        pDeferred->heatEvent = _SM_COLD(self)->heatEvent;
+        _SM_COLD(self)->heatEvent = 0;
+#endif
+        return;
+    }
+
+    _SM_ExternalEvent(self, selfConst, transitions[self->currentState], pEventData);
+
+    if (pQueue && pQueue->count)
+        SM_Redispatch(self, selfConst, FALSE);
+}
+#endif
+
+#ifdef SM_BUDGET
+// Continues the pending internal event of a yielded instance. The caller 
+// holds the instance lock, if any. Returns TRUE if the instance yielded again.
+static BOOL SM_ResumeYielded(SM_StateMachine* self)
+{
+    const SM_StateMachineConst* selfConst;
+
+    // Nothing to do if the transitions were already completed
+    selfConst = _SM_COLD(self)->pYieldConst;
+    if (!selfConst)
+        return FALSE;
+
+    _SM_COLD(self)->pYieldConst = NULL;
+    if (_SM_COLD(self)->pBudget)
+        ATOMIC_FetchAdd32(&_SM_COLD(self)->pBudget->resumes, 1);
+
+    SM_Dispatch(self, selfConst SM_COUNTERS_LOOKUP(selfConst));
+
+    return _SM_COLD(self)->pYieldConst != NULL;
+}
+
+// Continues the pending internal event of a yielded instance. Returns TRUE
+// if the instance yielded again.
+BOOL _SM_Resume(SM_StateMachine* self)
+{
+    BOOL yielded;
+
+    ASSERT_TRUE(self);
+
+    _SM_LOCK(self);
+    yielded = SM_ResumeYielded(self);
+    _SM_UNLOCK(self);
+
+    return yielded;
+}
+
+// Completes the pending transitions of a yielded instance before it 
+// handles an external event, preserving run-to-completion
+void _SM_CompleteYielded(SM_StateMachine* self)
+{
+    ASSERT_TRUE(self);
+
+    if (_SM_COLD(self)->pYieldConst)
+    {
+        if (_SM_COLD(self)->pBudget)
+            ATOMIC_FetchAdd32(&_SM_COLD(self)->pBudget->forced, 1);
+        while (SM_ResumeYielded(self))
+            ;
+    }
+}
+#endif
+
 // Generates an internal event. Called from within a state 
 // function to transition to a new state
 void _SM_InternalEvent(SM_StateMachine* self, BYTE newState, void* pEventData)
 {
     ASSERT_TRUE(self);
 
-    self->pEventData = pEventData;
-    self->eventGenerated = TRUE;
+    _SM_COLD(self)->pEventData = pEventData;
+    _SM_SET_EVENT_GENERATED(self, TRUE);
     self->newState = newState;
 }
 
 // The state engine executes the state machine states
-void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst)
+void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst _SM_COUNTERS_PARAM)
 {
     void* pDataTemp = NULL;
+#ifdef SM_BUDGET
+    const SM_Budget* pBudget = _SM_COLD(self)->pBudget;
+    UINT32 transitions = 0;
+    UINT64 startUs = SM_BUDGET_START(pBudget);
+#endif
+#ifdef SM_HEATMAP
+    BYTE heatEvent;
+#endif
 
     ASSERT_TRUE(self);
     ASSERT_TRUE(selfConst);
 
     // While events are being generated keep executing states
-    while (self->eventGenerated)
+    while (_SM_GET_EVENT_GENERATED(self))
     {
         // Error check that the new state is valid before proceeding
         ASSERT_TRUE(self->newState < selfConst->maxStates);
@@ -60,13 +845,34 @@ void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfCons
         SM_StateFunc state = selfConst->stateMap[self->newState].pStateFunc;
 
         // Copy of event data pointer
-        pDataTemp = self->pEventData;
+        pDataTemp = _SM_COLD(self)->pEventData;
 
         // Event data used up, reset the pointer
-        self->pEventData = NULL;
+        _SM_COLD(self)->pEventData = NULL;
 
         // Event used up, reset the flag
-        self->eventGenerated = FALSE;
+        _SM_SET_EVENT_GENERATED(self, FALSE);
+
+#ifdef SM_HEATMAP
+        // Only the first state executed is caused by the external event
+        heatEvent = _SM_COLD(self)->heatEvent;
+        _SM_COLD(self)->heatEvent = 0;
+#endif
+
+        // Leaving the current state releases its scratch memory
+        if (self->newState != self->currentState)
+            SM_ARENA_RESET(self);
+
+#ifdef SM_COUNTERS
+        if (self->newState != self->currentState)
+            SM_COUNT(pCounters, transitions);
+        else
+            SM_COUNT(pCounters, selfTransitions);
+#endif
+
+#ifdef SM_HEATMAP
+        SM_HEAT_COUNT(self, selfConst, heatEvent);
+#endif
 
         // Switch to the new current state
         self->currentState = self->newState;
@@ -75,26 +881,53 @@ void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfCons
         ASSERT_TRUE(state != NULL);
         state(self, pDataTemp);
 
+        // Notify the observer of the state executed
+        if (_SM_COLD(self)->observer)
+            _SM_COLD(self)->observer(self, self->currentState);
+
         // If event data was used, then delete it
         if (pDataTemp)
         {
-            SM_XFree(pDataTemp);
+            SM_FREE_EVENT_DATA(pDataTemp);
             pDataTemp = NULL;
         }
+
+#ifdef SM_COUNTERS
+        // Count an internal event generated by the state
+        if (_SM_GET_EVENT_GENERATED(self))
+            SM_COUNT(pCounters, internalEvents);
+#endif
+
+#ifdef SM_BUDGET
+        // Yield the remaining transitions once the budget is spent
+        if (_SM_GET_EVENT_GENERATED(self) && SM_BudgetSpent(pBudget, ++transitions, startUs))
+        {
+            SM_Yield(self, selfConst);
+            break;
+        }
+#endif
     }
 }
 
 // The state engine executes the extended state machine states
-void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfConst)
+void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfConst _SM_COUNTERS_PARAM)
 {
     BOOL guardResult = TRUE;
     void* pDataTemp = NULL;
+#ifdef SM_BUDGET
+    const SM_Budget* pBudget = _SM_COLD(self)->pBudget;
+    UINT32 transitions = 0;
+    UINT64 startUs = SM_BUDGET_START(pBudget);
+#endif
+#ifdef SM_HEATMAP
+    BYTE heatEvent;
+#endif
 
     ASSERT_TRUE(self);
     ASSERT_TRUE(selfConst);
 
     // While events are being generated keep executing states
-    while (self->eventGenerated)
+    while (_SM_GET_EVENT_GENERATED(self))
     {
         // Error check that the new state is valid before proceeding
         ASSERT_TRUE(self->newState < selfConst->maxStates);
@@ -106,13 +939,19 @@ void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfCo
         SM_ExitFunc exit = selfConst->stateMapEx[self->currentState].pExitFunc;
 
         // Copy of event data pointer
-        pDataTemp = self->pEventData;
+        pDataTemp = _SM_COLD(self)->pEventData;
 
         // Event data used up, reset the pointer
-        self->pEventData = NULL;
+        _SM_COLD(self)->pEventData = NULL;
 
         // Event used up, reset the flag
-        self->eventGenerated = FALSE;
+        _SM_SET_EVENT_GENERATED(self, FALSE);
+
+#ifdef SM_HEATMAP
+        // Only the first state executed is caused by the external event
+        heatEvent = _SM_COLD(self)->heatEvent;
+        _SM_COLD(self)->heatEvent = 0;
+#endif
 
         // Execute the guard condition
         if (guard != NULL)
@@ -128,13 +967,28 @@ void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfCo
                 if (exit != NULL)
                     exit(self);
 
+                // Release the scratch memory used within the exited state
+                SM_ARENA_RESET(self);
+
                 // Execute the state entry action on the new state
                 if (entry != NULL)
                     entry(self, pDataTemp);
 
                 // Ensure exit/entry actions didn't call SM_InternalEvent by accident 
-                ASSERT_TRUE(self->eventGenerated == FALSE);
+                ASSERT_TRUE(_SM_GET_EVENT_GENERATED(self) == FALSE);
+
+#ifdef SM_COUNTERS
+                SM_COUNT(pCounters, transitions);
+#endif
             }
+#ifdef SM_COUNTERS
+            else
+                SM_COUNT(pCounters, selfTransitions);
+#endif
+
+#ifdef SM_HEATMAP
+            SM_HEAT_COUNT(self, selfConst, heatEvent);
+#endif
 
             // Switch to the new current state
             self->currentState = self->newState;
@@ -142,13 +996,36 @@ void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfCo
             // Execute the state action passing in event data
             ASSERT_TRUE(state != NULL);
             state(self, pDataTemp);
+
+            // Notify the observer of the state executed
+            if (_SM_COLD(self)->observer)
+                _SM_COLD(self)->observer(self, self->currentState);
         }
+#ifdef SM_COUNTERS
+        else
+            SM_COUNT(pCounters, guardRejects);
+#endif
 
         // If event data was used, then delete it
         if (pDataTemp)
         {
-            SM_XFree(pDataTemp);
+            SM_FREE_EVENT_DATA(pDataTemp);
             pDataTemp = NULL;
         }
+
+#ifdef SM_COUNTERS
+        // Count an internal event generated by the state
+        if (_SM_GET_EVENT_GENERATED(self))
+            SM_COUNT(pCounters, internalEvents);
+#endif
+
+#ifdef SM_BUDGET
+        // Yield the remaining transitions once the budget is spent
+        if (_SM_GET_EVENT_GENERATED(self) && SM_BudgetSpent(pBudget, ++transitions, startUs))
+        {
+            SM_Yield(self, selfConst);
+            break;
+        }
+#endif
     }
 }
@@ -17,6 +17,7 @@
 
 #include "DataTypes.h"
 #include "Fault.h"
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,6 +27,7 @@ extern "C" {
 #define USE_SM_ALLOCATOR
 #ifdef USE_SM_ALLOCATOR
     #include "sm_allocator.h"
+    #include "x_allocator.h"
     #define SM_XAlloc(size)    SMALLOC_Alloc(size)
     #define SM_XFree(ptr)      SMALLOC_Free(ptr)
 #else
@@ -34,21 +36,218 @@ extern "C" {
     #define SM_XFree(ptr)      free(ptr)
 #endif
 
-enum { EVENT_IGNORED = 0xFE, CANNOT_HAPPEN = 0xFF };
+// Optional per event data type pools. EVENT_POOL_DEFINE creates a fixed 
+// block pool sized exactly for one event data type. Call EVENT_POOL_REGISTER
+// once at startup after SMALLOC_Init(). SM_XAlloc then allocates every 
+// request of exactly that size from the pool without a size class search. 
+// Event data types of equal size share the first pool registered. Once the
+// pool is exhausted, requests fall back to the SMALLOC size classes and are
+// counted as failedAllocations of the pool. The data is freed using SM_XFree
+// as usual. 
+// e.g. 
+// EVENT_POOL_DEFINE(MotorData, 4)
+// EVENT_POOL_REGISTER(MotorData);
+// MotorData* data = SM_XAlloc(sizeof(MotorData));
+#ifdef USE_SM_ALLOCATOR
+    // Event data pool block alignment. A literal power of two no less than
+    // the alignment of a pointer.
+    #define EVENT_POOL_ALIGN    8
+
+    #define EVENT_POOL_DECLARE(_eventData_) \
+        extern const ALLOC_HANDLE _eventData_##Pool;
+
+    #define EVENT_POOL_DEFINE(_eventData_, _maxBlocks_) \
+        XALLOC_DEFINE_ALIGNED(_eventData_##PoolAlloc, sizeof(_eventData_), _maxBlocks_, EVENT_POOL_ALIGN) \
+        const ALLOC_HANDLE _eventData_##Pool = &_eventData_##PoolAllocObj;
+
+    #define EVENT_POOL_REGISTER(_eventData_) \
+        SMALLOC_Register(_eventData_##Pool)
+#else
+    #define EVENT_POOL_DECLARE(_eventData_)
+    #define EVENT_POOL_DEFINE(_eventData_, _maxBlocks_)
+    #define EVENT_POOL_REGISTER(_eventData_)
+#endif
+
+enum { EVENT_DEFERRED = 0xFD, EVENT_IGNORED = 0xFE, CANNOT_HAPPEN = 0xFF };
 
 typedef void NoEventData;
 
-// State machine constant data
+// Define SM_COUNTERS to count events and transitions per state machine. 
+// Each state map has a set of counter shards, one cache line each. The first
+// SM_COUNTER_SHARDS - 1 threads to count each own a shard, incremented 
+// without locked instructions. Any further threads share the last shard, 
+// incremented atomically, so they contend with each other but never with 
+// the owning threads. Export the totals using the SMCounters module. 
+// #define SM_COUNTERS
+
+#ifdef SM_COUNTERS
+#define SM_COUNTER_SHARDS   8
+#define SM_CACHE_LINE       64
+
 typedef struct
+{
+    volatile UINT64 eventsReceived;
+    volatile UINT64 eventsIgnored;
+    volatile UINT64 guardRejects;
+    volatile UINT64 selfTransitions;
+    volatile UINT64 transitions;
+    volatile UINT64 internalEvents;
+} SM_Counters;
+
+typedef union
+{
+    SM_Counters counters;
+    BYTE pad[SM_CACHE_LINE];
+} SM_CounterShard;
+
+// Counters of one state machine, registered on its first event
+typedef struct SM_CounterSet
+{
+    const CHAR* name;
+    struct SM_CounterSet* pNext;
+    volatile UINT32 registered;
+    SM_CounterShard shards[SM_COUNTER_SHARDS];
+} SM_CounterSet;
+
+// List of registered counter sets
+extern SM_CounterSet* volatile SM_CounterSets;
+#endif
+
+// Define SM_HEATMAP to count each (from, to, event) transition per state 
+// machine and keep the state function names in the state map. Export the 
+// counts as a weighted graph using the SMHeatmap module. 
+// #define SM_HEATMAP
+
+#ifdef SM_HEATMAP
+// Event slots per state machine. Slot 0 counts the transitions caused by 
+// internal events, the following slots count each external event function.
+// The last slot, SM_HEATMAP_OTHER, counts the event functions beyond the 
+// first SM_HEATMAP_EVENTS - 2.
+#define SM_HEATMAP_EVENTS   8
+#define SM_HEATMAP_OTHER    (SM_HEATMAP_EVENTS - 1)
+
+// Transition counts of one state machine, registered on its first event. 
+// The counts are shared by every instance of the state machine, so they are
+// updated atomically.
+typedef struct SM_Heatmap
+{
+    const CHAR* name;
+    volatile UINT32* counts;
+    const struct SM_StateMachineConst* pConst;
+    struct SM_Heatmap* pNext;
+    volatile UINT32 registered;
+    volatile UINT32 numEvents;
+    const CHAR* eventNames[SM_HEATMAP_EVENTS];
+} SM_Heatmap;
+
+// List of registered heatmaps
+extern SM_Heatmap* volatile SM_Heatmaps;
+#endif
+
+// State machine constant data
+typedef struct SM_StateMachineConst
 {
     const CHAR* name;
     const BYTE maxStates;
     const struct SM_StateStruct* stateMap;
     const struct SM_StateStructEx* stateMapEx;
+#ifdef SM_COUNTERS
+    SM_CounterSet* pCounters;
+#endif
+#ifdef SM_HEATMAP
+    SM_Heatmap* pHeatmap;
+#endif
 } SM_StateMachineConst;
 
+// Per instance scratch arena. State, guard, entry and exit functions bump 
+// allocate temporary memory using SM_ArenaAlloc. The state engine releases 
+// all of it at once when the instance leaves the state, after the exit 
+// action. The memory persists while the instance stays in the state, 
+// including across self transitions, so a state handling many events calls
+// SM_ArenaReset once its scratch memory is no longer needed. Attach an 
+// arena to an instance using SM_SetArena.
+typedef struct
+{
+    BYTE* pBuffer;
+    size_t size;
+    size_t used;
+} SM_Arena;
+
+// Define SM_DEFER to support EVENT_DEFERRED transition map entries. An event
+// deferred in a state is stored with its event data in the instance deferral
+// queue, then generated again in order once the instance has left the state.
+// Attach a queue to an instance using SM_SetDeferQueue.
+// #define SM_DEFER
+
+#ifdef SM_DEFER
+// A deferred event. The transition map of the event function is kept to 
+// look up the event again in later states.
+typedef struct
+{
+    const BYTE* transitions;
+    void* pEventData;
+#ifdef SM_HEATMAP
+    BYTE heatEvent;
+#endif
+} SM_Deferred;
+
+// Per instance deferral queue, in the order events were deferred. busy is 
+// set while the deferred events are generated again. stale is set when a 
+// yield under SM_BUDGET stopped the scan before every event was checked.
+typedef struct
+{
+    SM_Deferred* events;
+    UINT32 maxEvents;
+    UINT32 count;
+    BOOL busy;
+    BOOL stale;
+} SM_DeferQueue;
+#endif
+
+// Define SM_COMPACT to use an 8-byte hot instance record. The name, instance 
+// pointer and event data are moved to a cold side table indexed by 
+// instanceIndex, allowing very large arrays of state machine instances. 
+// #define SM_COMPACT
+
+// Define SM_LOCK to serialize the events of an instance generated from 
+// multiple threads. Attach a lock to an instance using SM_SetLock(). The 
+// lock is held from the transition map lookup until the state engine 
+// completes, so instances without a lock are unaffected. 
+//
+// The lock is not recursive. A state, guard, entry or exit function must not
+// generate an external event (SM_Event) to its own locked instance, nor to 
+// another locked instance that may in turn generate an event to it; doing so
+// deadlocks. Use SM_InternalEvent to transition the instance itself, or 
+// queue the event with SM_Post (see SMDispatcher.h). 
+// #define SM_LOCK
+#ifdef SM_LOCK
+    #include "LockGuard.h"
+#endif
+
+// Define SM_REGIONS to generate one event to several orthogonal regions, 
+// independent state machines that always receive the same events. See 
+// BEGIN_REGION_EVENT. 
+// #define SM_REGIONS
+
+// Define SM_BUDGET to bound the work done by the state engine per dispatch. 
+// Once an event has executed the transitions or time of the budget attached
+// by SM_SetBudget(), the engine yields, leaving the pending internal event 
+// for SM_Resume(). 
+// #define SM_BUDGET
+
+// Define SM_SEQLOCK to let other threads read an instance consistently 
+// while its events execute, without blocking them. See SM_GetConsistent.
+// #define SM_SEQLOCK
+
+struct SM_StateMachine;
+
+// Called after each state function of an instance executes. See 
+// SM_SetTransitionObserver.
+typedef void (*SM_ObserverFunc)(struct SM_StateMachine* self, BYTE state);
+
+#ifndef SM_COMPACT
 // State machine instance data
-typedef struct 
+typedef struct SM_StateMachine
 {
     const CHAR* name;
     void* pInstance;
@@ -56,10 +255,82 @@ typedef struct
     BYTE currentState;
     BOOL eventGenerated;
     void* pEventData;
+    SM_Arena* pArena;
+    SM_ObserverFunc observer;
+#ifdef SM_SEQLOCK
+    volatile UINT32 seq;
+#endif
+#ifdef SM_BUDGET
+    struct SM_Budget* pBudget;
+    const SM_StateMachineConst* pYieldConst;
+#endif
+#ifdef SM_HEATMAP
+    BYTE heatEvent;
+#endif
+#ifdef SM_LOCK
+    LOCK_HANDLE hLock;
+#endif
+#ifdef SM_DEFER
+    SM_DeferQueue* pDeferQueue;
+#endif
+} SM_StateMachine;
+#else
+// State machine cold instance data. Only accessed when a state function 
+// needs the name or instance, or while event data is in flight.
+typedef struct
+{
+    const CHAR* name;
+    void* pInstance;
+    void* pEventData;
+    SM_Arena* pArena;
+    SM_ObserverFunc observer;
+#ifdef SM_SEQLOCK
+    volatile UINT32 seq;
+#endif
+#ifdef SM_BUDGET
+    struct SM_Budget* pBudget;
+    const SM_StateMachineConst* pYieldConst;
+#endif
+#ifdef SM_HEATMAP
+    BYTE heatEvent;
+#endif
+#ifdef SM_LOCK
+    LOCK_HANDLE hLock;
+#endif
+#ifdef SM_DEFER
+    SM_DeferQueue* pDeferQueue;
+#endif
+} SM_StateMachineCold;
+
+// State machine hot instance data (8 bytes)
+typedef struct SM_StateMachine
+{
+    BYTE newState;
+    BYTE currentState;
+    BYTE flags;
+    BYTE reserved;
+    UINT32 instanceIndex;
 } SM_StateMachine;
 
+// SM_StateMachine flags bits
+#define SM_FLAG_EVENT_GENERATED     0x01
+
+// Index of an instance not yet bound to a cold table entry
+#define SM_INDEX_UNBOUND    0xFFFFFFFF
+
+// Index of an instance being bound by another thread
+#define SM_INDEX_BINDING    0xFFFFFFFE
+
+// Number of cold table entries available before SM_CompactInit() is called
+#define SM_COMPACT_DEFAULT_INSTANCES    16
+
+extern SM_StateMachineCold* SM_ColdTable;
+#endif
+
 // Generic state function signatures
 typedef void (*SM_StateFunc)(SM_StateMachine* self, void* pEventData);
+typedef void (*SM_EventFunc)(SM_StateMachine* self, void* pEventData);
+typedef void (*SM_YieldFunc)(SM_StateMachine* self);
 typedef BOOL (*SM_GuardFunc)(SM_StateMachine* self, void* pEventData);
 typedef void (*SM_EntryFunc)(SM_StateMachine* self, void* pEventData);
 typedef void (*SM_ExitFunc)(SM_StateMachine* self);
@@ -67,6 +338,9 @@ typedef void (*SM_ExitFunc)(SM_StateMachine* self);
 typedef struct SM_StateStruct
 {
     SM_StateFunc pStateFunc;
+#ifdef SM_HEATMAP
+    const CHAR* name;
+#endif
 } SM_StateStruct;
 
 typedef struct SM_StateStructEx
@@ -75,32 +349,293 @@ typedef struct SM_StateStructEx
     SM_GuardFunc pGuardFunc;
     SM_EntryFunc pEntryFunc;
     SM_ExitFunc pExitFunc;
+#ifdef SM_HEATMAP
+    const CHAR* name;
+#endif
 } SM_StateStructEx;
 
+// Private instance data accessors
+#ifndef SM_COMPACT
+#define _SM_COLD(_self_) \
+    (_self_)
+#define _SM_OBJ(_smName_) \
+    (&_smName_##Obj)
+#define _SM_GET_EVENT_GENERATED(_self_) \
+    ((_self_)->eventGenerated)
+#define _SM_SET_EVENT_GENERATED(_self_, _generated_) \
+    ((_self_)->eventGenerated = (_generated_))
+#else
+#define _SM_COLD(_self_) \
+    (&SM_ColdTable[(_self_)->instanceIndex])
+#define _SM_OBJ(_smName_) \
+    _SM_Bind(&_smName_##Obj, &_smName_##Cold)
+#define _SM_GET_EVENT_GENERATED(_self_) \
+    (((_self_)->flags & SM_FLAG_EVENT_GENERATED) != 0)
+#define _SM_SET_EVENT_GENERATED(_self_, _generated_) \
+    ((_self_)->flags = (BYTE)((_generated_) ? ((_self_)->flags | SM_FLAG_EVENT_GENERATED) : \
+        ((_self_)->flags & ~SM_FLAG_EVENT_GENERATED)))
+#endif
+
 // Public functions
 #define SM_Event(_smName_, _eventFunc_, _eventData_) \
-    _eventFunc_(&_smName_##Obj, _eventData_)
+    _eventFunc_(_SM_OBJ(_smName_), _eventData_)
 #define SM_Get(_smName_, _getFunc_) \
-    _getFunc_(&_smName_##Obj)
+    _getFunc_(_SM_OBJ(_smName_))
+#define SM_SetArena(_smName_, _arena_) \
+    (_SM_COLD(_SM_OBJ(_smName_))->pArena = (_arena_))
+
+// Sets the function called after every state function of the instance 
+// executes. Set before the instance receives events; pass NULL to remove
+// the observer. An instance has at most one observer.
+#define SM_SetTransitionObserver(_smName_, _observer_) \
+    _SM_SetObserver(_SM_OBJ(_smName_), _observer_)
+#ifdef SM_DEFER
+#define SM_SetDeferQueue(_smName_, _queue_) \
+    (_SM_COLD(_SM_OBJ(_smName_))->pDeferQueue = (_queue_))
+#endif
+#ifdef SM_LOCK
+#define SM_SetLock(_smName_, _hLock_) \
+    (_SM_COLD(_SM_OBJ(_smName_))->hLock = (_hLock_))
+#endif
+
+#ifdef SM_REGIONS
+// Orthogonal regions. Each region is an ordinary state machine instance 
+// with its own state and transition maps. The regions listed between 
+// BEGIN_REGION_EVENT and END_REGION_EVENT receive one event as a unit, 
+// sharing a single event data allocation. The event data is neither copied
+// nor freed by the regions, but freed once after the last region. Region 
+// states must not pass the event data on to SM_InternalEvent. Use from C;
+// the event data converts from void*. 
+//
+// With SM_LOCK, the locks of all the regions are acquired before the first
+// region executes and released after the last, in address order so region 
+// events from several threads cannot deadlock. No other event interleaves 
+// with a region event, as if the regions were one composite instance.
+// e.g. 
+// MotorData* data = SM_XAlloc(sizeof(MotorData));
+// BEGIN_REGION_EVENT(data)
+//     REGION_EVENT(MotorRegionSM, MTR_SetSpeed)
+//     REGION_EVENT(FaultRegionSM, FLT_SetSpeed)
+// END_REGION_EVENT;
+
+// Maximum number of regions receiving one event
+#define SM_MAX_REGIONS      8
+
+// The regions receiving one event, built by REGION_EVENT
+typedef struct SM_RegionEvent
+{
+    SM_StateMachine* regions[SM_MAX_REGIONS];
+    SM_EventFunc eventFuncs[SM_MAX_REGIONS];
+    UINT32 count;
+#ifdef SM_LOCK
+    LOCK_HANDLE locks[SM_MAX_REGIONS];
+    UINT32 numLocks;
+    struct SM_RegionEvent* pPrev;
+#endif
+} SM_RegionEvent;
+
+#define BEGIN_REGION_EVENT(_eventData_) \
+    do { \
+        SM_RegionEvent _regionEvent_; \
+        void* _regionData_ = (_eventData_); \
+        _regionEvent_.count = 0;
+
+#define REGION_EVENT(_smName_, _eventFunc_) \
+        _SM_AddRegion(&_regionEvent_, _SM_OBJ(_smName_), (SM_EventFunc)(_eventFunc_));
+
+#define END_REGION_EVENT \
+        _SM_RegionEvent(&_regionEvent_, _regionData_); \
+    } while (0)
+
+void _SM_AddRegion(SM_RegionEvent* pEvent, SM_StateMachine* self, SM_EventFunc eventFunc);
+void _SM_RegionEvent(SM_RegionEvent* pEvent, void* pEventData);
+#endif
+
+#ifdef SM_SEQLOCK
+// Consistent reads from another thread. The state engine publishes the 
+// current state and instance data using a sequence lock, so a reader never
+// blocks the state machine thread. A read started while an event executes 
+// is retried. A state function must not read its own instance this way, as
+// the read would retry until the event completes, and asserts instead.
+// e.g. SM_GetConsistent(Motor1SM, MTR_GetSpeed, speed);
+#define SM_ReadBegin(_smName_) \
+    _SM_ReadBegin(_SM_OBJ(_smName_))
+#define SM_ReadRetry(_smName_, _seq_) \
+    _SM_ReadRetry(_SM_OBJ(_smName_), _seq_)
+#define SM_GetConsistent(_smName_, _getFunc_, _result_) \
+    do { \
+        UINT32 _seq_; \
+        do { \
+            _seq_ = SM_ReadBegin(_smName_); \
+            (_result_) = SM_Get(_smName_, _getFunc_); \
+        } while (SM_ReadRetry(_smName_, _seq_)); \
+    } while (0)
+#endif
+#define SM_GetCurrentState(_smName_) \
+    (_SM_OBJ(_smName_)->currentState)
+#define SM_GetObj(_smName_) \
+    _SM_OBJ(_smName_)
+
+#ifdef SM_BUDGET
+// Run-to-completion budget. A budget is attached to each instance it limits,
+// typically one budget per instance or per dispatcher. An instance without a
+// budget is unlimited. A yielded instance holds its pending internal event 
+// until SM_Resume() is called, typically by the scheduler notified through 
+// the budget yield handler. SM_Resume() returns TRUE if the instance yielded
+// again. An external event to a yielded instance first completes the pending
+// transitions regardless of budget, counted as forced. 
+// e.g. SM_BUDGET_DEFINE(motorBudget, 8, 0, NULL)
+//      SM_SetBudget(Motor1SM, &motorBudget);
+typedef struct SM_Budget
+{
+    UINT32 maxTransitions;
+    UINT32 maxUs;
+    SM_YieldFunc yieldHandler;
+    volatile UINT32 yields;
+    volatile UINT32 resumes;
+    volatile UINT32 forced;
+} SM_Budget;
+
+typedef struct
+{
+    UINT32 yields;
+    UINT32 resumes;
+    UINT32 forced;
+} SM_BudgetStats;
+
+// Defines a budget of _maxTransitions_ and _maxUs_ microseconds per dispatch, 
+// zero is unlimited. _yieldHandler_ is called from within the state engine 
+// when an instance yields, so it should only schedule SM_Resume(). 
+#define SM_BUDGET_DEFINE(_budgetName_, _maxTransitions_, _maxUs_, _yieldHandler_) \
+    static SM_Budget _budgetName_ = { _maxTransitions_, _maxUs_, _yieldHandler_, 0, 0, 0 };
+
+#define SM_SetBudget(_smName_, _budget_) \
+    (_SM_COLD(_SM_OBJ(_smName_))->pBudget = (_budget_))
+#define SM_Resume(_smName_) \
+    _SM_Resume(_SM_OBJ(_smName_))
+#define SM_IsYielded(_smName_) \
+    (_SM_COLD(_SM_OBJ(_smName_))->pYieldConst != NULL)
+
+void SM_GetBudgetStats(const SM_Budget* pBudget, SM_BudgetStats* pStats);
+BOOL _SM_Resume(SM_StateMachine* self);
+void _SM_CompleteYielded(SM_StateMachine* self);
+#define _SM_COMPLETE_YIELDED(_self_) \
+    _SM_CompleteYielded(_self_)
+#else
+#define _SM_COMPLETE_YIELDED(_self_)
+#endif
 
 // Protected functions
 #define SM_InternalEvent(_newState_, _eventData_) \
     _SM_InternalEvent(self, _newState_, _eventData_)
 #define SM_GetInstance(_instance_) \
-    (_instance_*)(self->pInstance);
+    (_instance_*)(_SM_COLD(self)->pInstance);
+#define SM_GetName() \
+    (_SM_COLD(self)->name)
+#define SM_ArenaAlloc(_size_) \
+    _SM_ArenaAlloc(self, _size_)
+#define SM_ArenaReset() \
+    _SM_ArenaReset(self)
 
 // Private functions
+#ifdef SM_COUNTERS
+// The counter shard of the calling thread, looked up once per dispatch
+#define _SM_COUNTERS_PARAM \
+    , SM_Counters* pCounters
+#else
+#define _SM_COUNTERS_PARAM
+#endif
 void _SM_ExternalEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, BYTE newState, void* pEventData);
+#ifdef SM_DEFER
+void _SM_DeferrableEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, const BYTE* transitions, void* pEventData);
+#endif
 void _SM_InternalEvent(SM_StateMachine* self, BYTE newState, void* pEventData);
-void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst);
-void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfConst);
+void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst _SM_COUNTERS_PARAM);
+void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfConst _SM_COUNTERS_PARAM);
+void* _SM_ArenaAlloc(SM_StateMachine* self, size_t size);
+void _SM_ArenaReset(SM_StateMachine* self);
+void _SM_SetObserver(SM_StateMachine* self, SM_ObserverFunc observer);
+void _SM_LockInstance(SM_StateMachine* self);
+void _SM_UnlockInstance(SM_StateMachine* self);
+#ifdef SM_SEQLOCK
+UINT32 _SM_ReadBegin(SM_StateMachine* self);
+BOOL _SM_ReadRetry(SM_StateMachine* self, UINT32 seq);
+#endif
+
+#ifdef SM_LOCK
+#ifdef SM_REGIONS
+// A lock held by a region event on the calling thread is not locked again
+BOOL _SM_RegionLockHeld(LOCK_HANDLE hLock);
+#define _SM_LOCK_NEEDED(_hLock_) \
+    ((_hLock_) && !_SM_RegionLockHeld(_hLock_))
+#else
+#define _SM_LOCK_NEEDED(_hLock_) \
+    ((_hLock_) != NULL)
+#endif
+#define _SM_LOCK(_self_) \
+    do { \
+        if (_SM_LOCK_NEEDED(_SM_COLD(_self_)->hLock)) \
+            LK_LOCK(_SM_COLD(_self_)->hLock); \
+    } while (0)
+#define _SM_UNLOCK(_self_) \
+    do { \
+        if (_SM_LOCK_NEEDED(_SM_COLD(_self_)->hLock)) \
+            LK_UNLOCK(_SM_COLD(_self_)->hLock); \
+    } while (0)
+#else
+#define _SM_LOCK(_self_)
+#define _SM_UNLOCK(_self_)
+#endif
+
+#ifdef SM_HEATMAP
+void _SM_HeatEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, volatile UINT32* pEventIndex, const CHAR* eventName);
+
+// Records the event function generating an external event
+#define _SM_HEAT_EVENT(_smName_) \
+    { \
+        static volatile UINT32 _eventIndex_ = 0; \
+        _SM_HeatEvent(self, &_smName_##Const, &_eventIndex_, __func__); \
+    }
+#else
+#define _SM_HEAT_EVENT(_smName_)
+#endif
+
+#ifdef SM_COMPACT
+// Compact instance functions
+void SM_CompactInit(SM_StateMachineCold* coldTable, UINT32 maxInstances);
+UINT32 SM_CompactCreate(SM_StateMachine* self, const CHAR* name, void* pInstance);
+SM_StateMachine* _SM_Bind(SM_StateMachine* self, const SM_StateMachineCold* cold);
+#endif
 
+#ifndef SM_COMPACT
 #define SM_DECLARE(_smName_) \
     extern SM_StateMachine _smName_##Obj; 
 
 #define SM_DEFINE(_smName_, _instance_) \
-    SM_StateMachine _smName_##Obj = { #_smName_, _instance_, \
-        0, 0, 0, 0 }; 
+    SM_StateMachine _smName_##Obj = { .name = #_smName_, .pInstance = _instance_ }; 
+#else
+#define SM_DECLARE(_smName_) \
+    extern SM_StateMachine _smName_##Obj; \
+    extern const SM_StateMachineCold _smName_##Cold;
+
+#define SM_DEFINE(_smName_, _instance_) \
+    const SM_StateMachineCold _smName_##Cold = { .name = #_smName_, .pInstance = _instance_ }; \
+    SM_StateMachine _smName_##Obj = { .instanceIndex = SM_INDEX_UNBOUND }; 
+#endif
+
+#ifdef SM_DEFER
+// Defines a deferral queue holding up to _maxEvents_ deferred events
+// e.g. SM_DEFER_QUEUE_DEFINE(motorDeferQueue, 4)
+#define SM_DEFER_QUEUE_DEFINE(_queueName_, _maxEvents_) \
+    static SM_Deferred _queueName_##Events[_maxEvents_]; \
+    static SM_DeferQueue _queueName_ = { _queueName_##Events, _maxEvents_, 0, FALSE, FALSE };
+#endif
+
+// Defines a scratch arena of _size_ bytes
+// e.g. SM_ARENA_DEFINE(motorArena, 256)
+#define SM_ARENA_DEFINE(_arenaName_, _size_) \
+    static BYTE _arenaName_##Buffer[_size_]; \
+    static SM_Arena _arenaName_ = { _arenaName_##Buffer, _size_, 0 };
 
 #define EVENT_DECLARE(_eventFunc_, _eventData_) \
     void _eventFunc_(SM_StateMachine* self, _eventData_* pEventData);
@@ -138,32 +673,70 @@ void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfCo
 #define EXIT_DEFINE(_exitFunc_) \
     static void EX_##_exitFunc_(SM_StateMachine* self)
 
+#ifdef SM_COUNTERS
+#define _SM_COUNTERS_DEFINE(_smName_) \
+    static SM_CounterSet _smName_##Counters = { .name = #_smName_ };
+#define _SM_COUNTERS_PTR(_smName_) \
+    , &_smName_##Counters
+#else
+#define _SM_COUNTERS_DEFINE(_smName_)
+#define _SM_COUNTERS_PTR(_smName_)
+#endif
+
+#ifdef SM_HEATMAP
+#define _SM_HEATMAP_DEFINE(_smName_) \
+    static volatile UINT32 _smName_##HeatCounts[SM_HEATMAP_EVENTS * \
+        (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])) * \
+        (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0]))]; \
+    static SM_Heatmap _smName_##Heatmap = { .name = #_smName_, .counts = _smName_##HeatCounts };
+#define _SM_HEATMAP_PTR(_smName_) \
+    , &_smName_##Heatmap
+#define _SM_STATE_NAME(_stateFunc_) \
+    , #_stateFunc_
+#else
+#define _SM_HEATMAP_DEFINE(_smName_)
+#define _SM_HEATMAP_PTR(_smName_)
+#define _SM_STATE_NAME(_stateFunc_)
+#endif
+
 #define BEGIN_STATE_MAP(_smName_) \
     static const SM_StateStruct _smName_##StateMap[] = { 
 
 #define STATE_MAP_ENTRY(_stateFunc_) \
-    { (SM_StateFunc)_stateFunc_ },
+    { (SM_StateFunc)_stateFunc_ _SM_STATE_NAME(_stateFunc_) },
 
 #define END_STATE_MAP(_smName_) \
     }; \
+    _SM_COUNTERS_DEFINE(_smName_) \
+    _SM_HEATMAP_DEFINE(_smName_) \
     static const SM_StateMachineConst _smName_##Const = { #_smName_, \
         (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])), \
-        _smName_##StateMap, NULL };
+        _smName_##StateMap, NULL _SM_COUNTERS_PTR(_smName_) _SM_HEATMAP_PTR(_smName_) };
 
 #define BEGIN_STATE_MAP_EX(_smName_) \
     static const SM_StateStructEx _smName_##StateMap[] = { 
 
 #define STATE_MAP_ENTRY_EX(_stateFunc_) \
-    { (SM_StateFunc)_stateFunc_, NULL, NULL, NULL },
+    { (SM_StateFunc)_stateFunc_, NULL, NULL, NULL _SM_STATE_NAME(_stateFunc_) },
 
 #define STATE_MAP_ENTRY_ALL_EX(_stateFunc_, _guardFunc_, _entryFunc_, _exitFunc_) \
-    { (SM_StateFunc)_stateFunc_, (SM_GuardFunc)_guardFunc_, (SM_EntryFunc)_entryFunc_, (SM_ExitFunc)_exitFunc_ },
+    { (SM_StateFunc)_stateFunc_, (SM_GuardFunc)_guardFunc_, (SM_EntryFunc)_entryFunc_, (SM_ExitFunc)_exitFunc_ _SM_STATE_NAME(_stateFunc_) },
 
 #define END_STATE_MAP_EX(_smName_) \
     }; \
+    _SM_COUNTERS_DEFINE(_smName_) \
+    _SM_HEATMAP_DEFINE(_smName_) \
     static const SM_StateMachineConst _smName_##Const = { #_smName_, \
         (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])), \
-        NULL, _smName_##StateMap };
+        NULL, _smName_##StateMap _SM_COUNTERS_PTR(_smName_) _SM_HEATMAP_PTR(_smName_) };
+
+#ifdef SM_DEFER
+#define _SM_EXTERNAL_EVENT(_smName_, _eventData_) \
+    _SM_DeferrableEvent(self, &_smName_##Const, TRANSITIONS, _eventData_)
+#else
+#define _SM_EXTERNAL_EVENT(_smName_, _eventData_) \
+    _SM_ExternalEvent(self, &_smName_##Const, TRANSITIONS[self->currentState], _eventData_)
+#endif
 
 #define BEGIN_TRANSITION_MAP \
     static const BYTE TRANSITIONS[] = { \
@@ -173,7 +746,11 @@ void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfCo
 
 #define END_TRANSITION_MAP(_smName_, _eventData_) \
     }; \
-    _SM_ExternalEvent(self, &_smName_##Const, TRANSITIONS[self->currentState], _eventData_); \
+    _SM_LOCK(self); \
+    _SM_COMPLETE_YIELDED(self); \
+    _SM_HEAT_EVENT(_smName_) \
+    _SM_EXTERNAL_EVENT(_smName_, _eventData_); \
+    _SM_UNLOCK(self); \
     C_ASSERT((sizeof(TRANSITIONS)/sizeof(BYTE)) == (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])));
 
 #ifdef __cplusplus
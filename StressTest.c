@@ -0,0 +1,384 @@
+// StressTest fires random sequences of external events at many instances of
+// a state machine from many threads, then checks the run invariants:
+//
+// - No CANNOT_HAPPEN transition is taken. The Stress state machine passes
+//   through transient states that only a racing event can observe, and a
+//   CANNOT_HAPPEN transition asserts within the state engine.
+// - No instance update was lost. Every start event executes ST_Running once
+//   and every ST_Stop continues to ST_Idle.
+// - All event data came from the registered event data pool, none fell
+//   back to the x_allocator size classes, and every fixed block allocator
+//   returns to zero blocks in use.
+//
+// The sustained events/sec is reported, so the test doubles as a scaling
+// benchmark. Built with SM_LOCK defined, each instance has its own lock.
+//
+// StressTest [events per thread] [threads]
+
+#include "StateMachine.h"
+#include "fb_allocator.h"
+#include "Fault.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <pthread.h>
+#endif
+
+#ifndef SM_LOCK
+    #error StressTest requires SM_LOCK
+#endif
+
+#define STRESS_MAX_THREADS  16
+#define STRESS_INSTANCES    64
+
+// State enumeration order must match the order of state
+// method entries in the state map
+enum States
+{
+    ST_IDLE,
+    ST_ARM,
+    ST_RUNNING,
+    ST_STOP,
+    ST_MAX_STATES
+};
+
+// Stress object structure
+typedef struct
+{
+    UINT32 value;
+    UINT32 runs;
+    UINT32 stops;
+    UINT32 idles;
+} Stress;
+
+// Event data structure. check is ~value, to detect corrupt or reused data.
+typedef struct
+{
+    UINT32 value;
+    UINT32 check;
+} StressData;
+
+// Each thread has up to two blocks of event data in flight, the start event
+// data and the copy passed on by ST_Arm. A thread cache also holds up to a
+// magazine of free blocks.
+#ifdef ALLOC_THREAD_CACHE
+    #define STRESS_POOL_BLOCKS  (STRESS_MAX_THREADS * (2 + ALLOC_MAGAZINE_SIZE))
+#else
+    #define STRESS_POOL_BLOCKS  (STRESS_MAX_THREADS * 2)
+#endif
+EVENT_POOL_DEFINE(StressData, STRESS_POOL_BLOCKS)
+
+// Per thread results
+typedef struct
+{
+    UINT32 seed;
+    UINT32 events;
+    UINT32 starts;
+    UINT32 stops;
+} StressThread;
+
+static Stress _objects[STRESS_INSTANCES];
+static SM_StateMachine _instances[STRESS_INSTANCES];
+#ifdef SM_COMPACT
+static SM_StateMachineCold _coldTable[STRESS_INSTANCES];
+#endif
+
+// State machine state functions
+STATE_DECLARE(Idle, NoEventData)
+STATE_DECLARE(Arm, StressData)
+STATE_DECLARE(Running, StressData)
+STATE_DECLARE(Stop, NoEventData)
+
+// State map to define state function order
+BEGIN_STATE_MAP(Stress)
+    STATE_MAP_ENTRY(ST_Idle)
+    STATE_MAP_ENTRY(ST_Arm)
+    STATE_MAP_ENTRY(ST_Running)
+    STATE_MAP_ENTRY(ST_Stop)
+END_STATE_MAP(Stress)
+
+// Start external event
+EVENT_DEFINE(STR_Start, StressData)
+{
+    BEGIN_TRANSITION_MAP                        // - Current State -
+        TRANSITION_MAP_ENTRY(ST_ARM)            // ST_Idle
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)     // ST_Arm
+        TRANSITION_MAP_ENTRY(ST_RUNNING)        // ST_Running
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)     // ST_Stop
+    END_TRANSITION_MAP(Stress, pEventData)
+}
+
+// Stop external event
+EVENT_DEFINE(STR_Stop, NoEventData)
+{
+    BEGIN_TRANSITION_MAP                        // - Current State -
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)     // ST_Idle
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)     // ST_Arm
+        TRANSITION_MAP_ENTRY(ST_STOP)           // ST_Running
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)     // ST_Stop
+    END_TRANSITION_MAP(Stress, pEventData)
+}
+
+// Idle until started
+STATE_DEFINE(Idle, NoEventData)
+{
+    Stress* pInstance = SM_GetInstance(Stress);
+    pInstance->value = 0;
+    pInstance->idles++;
+}
+
+// Transient state entered from ST_Idle, continues to ST_Running
+STATE_DEFINE(Arm, StressData)
+{
+    StressData* pData;
+
+    ASSERT_TRUE(pEventData && pEventData->check == ~pEventData->value);
+
+    // Pass a copy of the event data on, as the state engine frees this one
+    pData = SM_XAlloc(sizeof(StressData));
+    *pData = *pEventData;
+    SM_InternalEvent(ST_RUNNING, pData);
+}
+
+// Running, each start event updates the value
+STATE_DEFINE(Running, StressData)
+{
+    Stress* pInstance = SM_GetInstance(Stress);
+
+    ASSERT_TRUE(pEventData && pEventData->check == ~pEventData->value);
+    pInstance->value = pEventData->value;
+    pInstance->runs++;
+}
+
+// Transient state entered from ST_Running, continues to ST_Idle
+STATE_DEFINE(Stop, NoEventData)
+{
+    Stress* pInstance = SM_GetInstance(Stress);
+    pInstance->stops++;
+    SM_InternalEvent(ST_IDLE, NULL);
+}
+
+//------------------------------------------------------------------------------
+// STRESS_Random
+//------------------------------------------------------------------------------
+static UINT32 STRESS_Random(UINT32* pSeed)
+{
+    // xorshift32
+    UINT32 x = *pSeed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pSeed = x;
+    return x;
+}
+
+//------------------------------------------------------------------------------
+// STRESS_NowNs
+//------------------------------------------------------------------------------
+static UINT64 STRESS_NowNs(void)
+{
+    struct timespec ts;
+
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (UINT64)ts.tv_sec * 1000000000 + (UINT64)ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+// STRESS_Worker
+//------------------------------------------------------------------------------
+static void STRESS_Worker(StressThread* pThread)
+{
+    SM_StateMachine* self;
+    StressData* pData;
+    UINT32 i, random;
+
+    for (i = 0; i < pThread->events; i++)
+    {
+        random = STRESS_Random(&pThread->seed);
+        self = &_instances[random % STRESS_INSTANCES];
+
+        // Two starts for each stop keeps most instances running
+        if ((random >> 16) % 3)
+        {
+            pData = SM_XAlloc(sizeof(StressData));
+            pData->value = random;
+            pData->check = ~random;
+            STR_Start(self, pData);
+            pThread->starts++;
+        }
+        else
+        {
+            STR_Stop(self, NULL);
+            pThread->stops++;
+        }
+    }
+}
+
+#if defined(_WIN32)
+//------------------------------------------------------------------------------
+// STRESS_Thread
+//------------------------------------------------------------------------------
+static DWORD WINAPI STRESS_Thread(LPVOID pArg)
+{
+    STRESS_Worker((StressThread*)pArg);
+    return 0;
+}
+#else
+//------------------------------------------------------------------------------
+// STRESS_Thread
+//------------------------------------------------------------------------------
+static void* STRESS_Thread(void* pArg)
+{
+    STRESS_Worker((StressThread*)pArg);
+    return NULL;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// STRESS_Run
+//------------------------------------------------------------------------------
+static void STRESS_Run(StressThread* threads, UINT32 numThreads)
+{
+    UINT32 t;
+#if defined(_WIN32)
+    HANDLE handles[STRESS_MAX_THREADS];
+
+    for (t = 0; t < numThreads; t++)
+    {
+        handles[t] = CreateThread(NULL, 0, STRESS_Thread, &threads[t], 0, NULL);
+        ASSERT_TRUE(handles[t] != NULL);
+    }
+    WaitForMultipleObjects(numThreads, handles, TRUE, INFINITE);
+    for (t = 0; t < numThreads; t++)
+        CloseHandle(handles[t]);
+#else
+    pthread_t handles[STRESS_MAX_THREADS];
+    int err;
+
+    for (t = 0; t < numThreads; t++)
+    {
+        err = pthread_create(&handles[t], NULL, STRESS_Thread, &threads[t]);
+        ASSERT_TRUE(err == 0);
+    }
+    for (t = 0; t < numThreads; t++)
+        pthread_join(handles[t], NULL);
+#endif
+}
+
+//------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+    StressThread threads[STRESS_MAX_THREADS] = { { 0 } };
+    ALLOC_Stats stats[16];
+    ALLOC_Stats poolStats;
+    UINT32 eventsPerThread = 500000;
+    UINT32 numThreads = 8;
+    UINT64 starts = 0, stops = 0, runs = 0, stopStates = 0, idles = 0;
+    UINT64 startNs, elapsedNs;
+    UINT16 count, i;
+    UINT32 t;
+    int result = 0;
+
+    if (argc > 1)
+        eventsPerThread = (UINT32)strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        numThreads = (UINT32)strtoul(argv[2], NULL, 10);
+    if (numThreads < 1 || numThreads > STRESS_MAX_THREADS)
+    {
+        printf("threads must be 1 to %u\n", STRESS_MAX_THREADS);
+        return 1;
+    }
+
+    ALLOC_Init();
+    SMALLOC_Init();
+    EVENT_POOL_REGISTER(StressData);
+
+#ifdef SM_COMPACT
+    SM_CompactInit(_coldTable, STRESS_INSTANCES);
+#endif
+    for (i = 0; i < STRESS_INSTANCES; i++)
+    {
+#ifdef SM_COMPACT
+        SM_CompactCreate(&_instances[i], "Stress", &_objects[i]);
+#else
+        _instances[i].name = "Stress";
+        _instances[i].pInstance = &_objects[i];
+#endif
+        _SM_COLD(&_instances[i])->hLock = LK_CREATE();
+    }
+
+    for (t = 0; t < numThreads; t++)
+    {
+        threads[t].seed = 2463534242u + t * 7919;
+        threads[t].events = eventsPerThread;
+    }
+
+    printf("Stress %u instances, %u threads, %u events per thread\n",
+        STRESS_INSTANCES, numThreads, eventsPerThread);
+
+    startNs = STRESS_NowNs();
+    STRESS_Run(threads, numThreads);
+    elapsedNs = STRESS_NowNs() - startNs;
+
+    for (t = 0; t < numThreads; t++)
+    {
+        starts += threads[t].starts;
+        stops += threads[t].stops;
+    }
+    for (i = 0; i < STRESS_INSTANCES; i++)
+    {
+        runs += _objects[i].runs;
+        stopStates += _objects[i].stops;
+        idles += _objects[i].idles;
+    }
+
+    printf("%llu events in %.3f s, %.0f events/sec\n", (unsigned long long)(starts + stops),
+        elapsedNs / 1e9, (starts + stops) * 1e9 / elapsedNs);
+
+    // Every start executes ST_Running once, directly or through ST_Arm. A 
+    // stop to an idle instance is ignored, otherwise ST_Stop continues to
+    // ST_Idle.
+    if (runs != starts || stopStates != idles || stopStates > stops)
+    {
+        printf("FAIL: %llu starts ran %llu times, %llu stops executed %llu ST_Stop and %llu ST_Idle\n",
+            (unsigned long long)starts, (unsigned long long)runs, (unsigned long long)stops,
+            (unsigned long long)stopStates, (unsigned long long)idles);
+        result = 1;
+    }
+
+    // Event data is only ever allocated from the StressData pool, and every
+    // block is back in its allocator
+    ALLOC_GetAllocatorStats(StressDataPool, &poolStats);
+    count = ALLOC_GetStats(stats, sizeof(stats) / sizeof(stats[0]));
+    for (i = 0; i < count; i++)
+    {
+        if (stats[i].blocksInUse != 0 || stats[i].blocksCached != 0)
+        {
+            printf("FAIL: %s: %llu blocks in use, %llu cached\n", stats[i].name,
+                (unsigned long long)stats[i].blocksInUse, (unsigned long long)stats[i].blocksCached);
+            result = 1;
+        }
+        if (stats[i].name != poolStats.name && stats[i].allocations != 0)
+        {
+            printf("FAIL: %s: %llu event data allocations fell back to the x_allocator\n",
+                stats[i].name, (unsigned long long)stats[i].allocations);
+            result = 1;
+        }
+    }
+
+    for (i = 0; i < STRESS_INSTANCES; i++)
+        LK_DESTROY(_SM_COLD(&_instances[i])->hLock);
+    ALLOC_Term();
+
+    printf("%s\n", result ? "FAIL" : "PASS");
+    return result;
+}
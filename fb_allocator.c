@@ -1,24 +1,107 @@
 #include "fb_allocator.h"
 #include "DataTypes.h"
 #include "Fault.h"
+#include "Atomic.h"
 #include <string.h>
 
 // Define USE_LOCK to use the default lock implementation
 #define USE_LOCKS
 #ifdef USE_LOCKS
     #include "LockGuard.h"
-    static LOCK_HANDLE _hLock;
 #else
     #pragma message("WARNING: Define software lock.")
-    typedef int LOCK_HANDLE;
-    static LOCK_HANDLE _hLock;
+    #undef LK_CREATE
+    #undef LK_DESTROY
+    #undef LK_LOCK
+    #undef LK_UNLOCK
 
-    #define LK_CREATE()     (1)
+    #define LK_CREATE()     ((LOCK_HANDLE)1)
     #define LK_DESTROY(h)  
     #define LK_LOCK(h)    
     #define LK_UNLOCK(h)  
 #endif
 
+// With LK_SPIN_LOCK the per-allocator lock is stored within the allocator
+#if defined(USE_LOCKS) && defined(LK_SPIN_LOCK)
+    #define ALLOC_LOCK_CREATE(_self_)   LK_Init(&(_self_)->lock)
+    #define ALLOC_LOCK_DESTROY(_self_)
+#else
+    #define ALLOC_LOCK_CREATE(_self_)   LK_CREATE()
+    #define ALLOC_LOCK_DESTROY(_self_)  LK_DESTROY((_self_)->hLock)
+#endif
+
+// The per-allocator lock guards the free-list, pool index and statistics.
+// The lock-free implementation uses atomic operations instead.
+#ifndef ALLOC_LOCK_FREE
+    #define ALLOC_LOCK(_self_)      LK_LOCK((_self_)->hLock)
+    #define ALLOC_UNLOCK(_self_)    LK_UNLOCK((_self_)->hLock)
+#else
+    #define ALLOC_LOCK(_self_)
+    #define ALLOC_UNLOCK(_self_)
+
+    // Lock-free free-list head packing. See ALLOC_Allocator::freeHead.
+    #define ALLOC_HEAD_INDEX(_head_)    ((UINT32)(_head_))
+    #define ALLOC_HEAD_TAG(_head_)      ((UINT32)((_head_) >> 32))
+    #define ALLOC_HEAD_MAKE(_tag_, _index_) \
+        (((UINT64)(_tag_) << 32) | (UINT64)(_index_))
+
+    // Each free block stores the next free block index + 1 in its first bytes
+    #define ALLOC_NEXT_INDEX(_block_ptr_)   (*(volatile UINT32*)(_block_ptr_))
+#endif
+
+// An allocator is registered once its lock is published. See ALLOC_Register().
+#define ALLOC_REGISTERED(_self_) \
+    (ATOMIC_LoadPtr((void* volatile*)&(_self_)->hLock) != NULL)
+
+// Total number of blocks including all slabs of a growable allocator
+#define ALLOC_CAPACITY(_self_) \
+    ((_self_)->maxBlocks * ((UINT32)(_self_)->maxSlabs + 1))
+
+#ifdef ALLOC_THREAD_CACHE
+    #if defined(_MSC_VER)
+        #define ALLOC_THREAD_LOCAL  __declspec(thread)
+    #else
+        #define ALLOC_THREAD_LOCAL  __thread
+    #endif
+    #if defined(_WIN32)
+        #include <windows.h>
+    #else
+        #include <pthread.h>
+    #endif
+
+    // A per-thread stack of free blocks for one allocator. The count is 
+    // also read by other threads taking a statistics snapshot.
+    typedef struct
+    {
+        void* blocks[ALLOC_MAGAZINE_SIZE];
+        volatile UINT32 count;
+    } ALLOC_Magazine;
+
+    // Each thread has one magazine per cached allocator. A thread cache is 
+    // registered on first use and flushed when the thread exits.
+    typedef struct ALLOC_ThreadCache
+    {
+        ALLOC_Magazine magazines[ALLOC_MAX_CACHED_ALLOCATORS];
+        struct ALLOC_ThreadCache* pNext;
+        BOOL registered;
+    } ALLOC_ThreadCache;
+
+    static ALLOC_THREAD_LOCAL ALLOC_ThreadCache _threadCache;
+
+    // Singly linked list of registered thread caches, protected by _hLock
+    static ALLOC_ThreadCache* _pThreadCaches = NULL;
+
+    // Number of allocators assigned a thread cache magazine
+    static UINT16 _cachedAllocators = 0;
+
+    // Thread exit notification, created by ALLOC_Init()
+    #if defined(_WIN32)
+        static DWORD _exitKey = FLS_OUT_OF_INDEXES;
+    #else
+        static pthread_key_t _exitKey;
+    #endif
+#endif
+
 // Get a pointer to the client's area within a memory block
 #define GET_CLIENT_PTR(_block_ptr_) \
     (_block_ptr_ ? ((void*)((char*)_block_ptr_)) : NULL)
@@ -27,36 +110,130 @@
 #define GET_BLOCK_PTR(_client_ptr_) \
     (_client_ptr_ ? ((void*)((char*)_client_ptr_)) : NULL)
 
+// Protects the list of registered allocators. Each allocator instance 
+// has its own lock for alloc/free.
+static LOCK_HANDLE _hLock;
+
+// Singly linked list of registered allocators
+static ALLOC_Allocator* _pAllocators = NULL;
+
 static void* ALLOC_NewBlock(ALLOC_Allocator* alloc);
+static char* ALLOC_GetSlab(ALLOC_Allocator* alloc, UINT32 slab);
+static char* ALLOC_NewSlab(ALLOC_Allocator* alloc);
+static void ALLOC_FreeSlab(ALLOC_Allocator* alloc, char* pSlab);
+#ifndef ALLOC_LOCK_FREE
 static void ALLOC_Push(ALLOC_Allocator* alloc, void* pBlock);
 static void* ALLOC_Pop(ALLOC_Allocator* alloc);
+#endif
+static UINT32 ALLOC_PopBulk(ALLOC_Allocator* alloc, void** blocks, UINT32 count);
+static void ALLOC_PushBulk(ALLOC_Allocator* alloc, void** blocks, UINT32 count);
+static void ALLOC_AllocStats(ALLOC_Allocator* alloc, UINT32 count);
+static void ALLOC_FreeStats(ALLOC_Allocator* alloc, UINT32 count);
+static void ALLOC_FailStats(ALLOC_Allocator* alloc);
+static void ALLOC_ReadStats(ALLOC_Allocator* alloc, ALLOC_Stats* pStats);
+static UINT32 ALLOC_SharedAlloc(ALLOC_Allocator* alloc, void** blocks, UINT32 count);
+static void ALLOC_SharedFree(ALLOC_Allocator* alloc, void** blocks, UINT32 count);
+
+//----------------------------------------------------------------------------
+// ALLOC_NewSlab
+//----------------------------------------------------------------------------
+static char* ALLOC_NewSlab(ALLOC_Allocator* self)
+{
+    size_t slabSize = self->maxBlocks * self->blockSize;
+    char* pMem;
+    char* pSlab;
+
+    if (self->alignment <= ALLOC_MEM_ALIGN)
+        return (char*)ALLOC_SLAB_ALLOC(slabSize);
 
+    // Over allocate so the slab blocks are aligned the same as the static 
+    // pool blocks. The memory returned by ALLOC_SLAB_ALLOC is stored just 
+    // before the slab for ALLOC_FreeSlab().
+    pMem = (char*)ALLOC_SLAB_ALLOC(slabSize + self->alignment + sizeof(char*));
+    if (!pMem)
+        return NULL;
+
+    pSlab = pMem + sizeof(char*) + self->alignOffset;
+    pSlab += (self->alignment - ((size_t)pSlab % self->alignment)) % self->alignment;
+    pSlab -= self->alignOffset;
+    memcpy(pSlab - sizeof(char*), &pMem, sizeof(pMem));
+
+    return pSlab;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FreeSlab
+//----------------------------------------------------------------------------
+static void ALLOC_FreeSlab(ALLOC_Allocator* self, char* pSlab)
+{
+    char* pMem = pSlab;
+
+    if (self->alignment > ALLOC_MEM_ALIGN)
+        memcpy(&pMem, pSlab - sizeof(char*), sizeof(pMem));
+
+    ALLOC_SLAB_FREE(pMem);
+}
+
+#ifndef ALLOC_LOCK_FREE
 //----------------------------------------------------------------------------
 // ALLOC_NewBlock
 //----------------------------------------------------------------------------
 static void* ALLOC_NewBlock(ALLOC_Allocator* self)
 {
-    ALLOC_Block* pBlock = NULL;
-
-    LK_LOCK(_hLock);
+    char* pSlab = NULL;
 
-    // If we have not exceeded the pool maximum
-    if (self->poolIndex < self->maxBlocks)
+    // Caller holds the allocator lock
+    for (;;)
     {
-        // Get pointer to a new fixed memory block within the pool
-        pBlock = (void*)(self->pPool + (self->poolIndex++ * self->blockSize));
+        // If we have not exceeded the pool maximum
+        if (self->poolIndex < self->maxBlocks)
+        {
+            // Get pointer to a new fixed memory block within the pool
+            return (void*)(self->pPool + (self->poolIndex++ * self->blockSize));
+        }
+
+        if (self->poolIndex >= ALLOC_CAPACITY(self))
+            return NULL;
+
+        // Get pointer to a new fixed memory block within a chained slab
+        pSlab = self->ppSlabs[self->poolIndex / self->maxBlocks];
+        if (pSlab)
+            return (void*)(pSlab + ((self->poolIndex++ % self->maxBlocks) * self->blockSize));
+
+        // Chain the slab, then check again since the lock was released
+        if (!ALLOC_GetSlab(self, self->poolIndex / self->maxBlocks))
+            return NULL;
     }
+} 
 
-    LK_UNLOCK(_hLock);
+//----------------------------------------------------------------------------
+// ALLOC_GetSlab
+//----------------------------------------------------------------------------
+static char* ALLOC_GetSlab(ALLOC_Allocator* self, UINT32 slab)
+{
+    char* pSlab = NULL;
 
-    if (!pBlock)
+    // Caller holds the allocator lock. It is released while the slab memory 
+    // is allocated or freed so other threads are not held up by the heap.
+    ALLOC_UNLOCK(self);
+    pSlab = ALLOC_NewSlab(self);
+    ALLOC_LOCK(self);
+
+    // Chain the new slab unless another thread did so meanwhile
+    if (pSlab && !self->ppSlabs[slab])
     {
-        // Out of fixed block memory
-        ASSERT();
+        self->ppSlabs[slab] = pSlab;
+        self->slabs++;
+    }
+    else if (pSlab)
+    {
+        ALLOC_UNLOCK(self);
+        ALLOC_FreeSlab(self, pSlab);
+        ALLOC_LOCK(self);
     }
 
-    return pBlock;
-} 
+    return self->ppSlabs[slab];
+}
 
 //----------------------------------------------------------------------------
 // ALLOC_Push
@@ -69,15 +246,11 @@ static void ALLOC_Push(ALLOC_Allocator* self, void* pBlock)
     // Get a pointer to the client's location within the block
     ALLOC_Block* pClient = (ALLOC_Block*)GET_CLIENT_PTR(pBlock);
 
-    LK_LOCK(_hLock);
-
     // Point client block's next pointer to head
     pClient->pNext = self->pHead;
 
     // The client block is now the new head
     self->pHead = pClient;
-
-    LK_UNLOCK(_hLock); 
 }
 
 //----------------------------------------------------------------------------
@@ -87,8 +260,6 @@ static void* ALLOC_Pop(ALLOC_Allocator* self)
 {
     ALLOC_Block* pBlock = NULL;
 
-    LK_LOCK(_hLock);
-
     // Is the free-list empty?
     if (self->pHead)
     {
@@ -99,16 +270,535 @@ static void* ALLOC_Pop(ALLOC_Allocator* self)
         self->pHead = self->pHead->pNext;
     }
 
-    LK_UNLOCK(_hLock); 
     return GET_BLOCK_PTR(pBlock);
 } 
 
+//----------------------------------------------------------------------------
+// ALLOC_PopBulk
+//----------------------------------------------------------------------------
+static UINT32 ALLOC_PopBulk(ALLOC_Allocator* self, void** blocks, UINT32 count)
+{
+    UINT32 popped = 0;
+
+    // Pop blocks until the free-list is empty or count reached
+    while (popped < count && (blocks[popped] = ALLOC_Pop(self)) != NULL)
+        popped++;
+
+    return popped;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_PushBulk
+//----------------------------------------------------------------------------
+static void ALLOC_PushBulk(ALLOC_Allocator* self, void** blocks, UINT32 count)
+{
+    UINT32 i;
+
+    for (i = 0; i < count; i++)
+        ALLOC_Push(self, blocks[i]);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_AllocStats
+//----------------------------------------------------------------------------
+static void ALLOC_AllocStats(ALLOC_Allocator* self, UINT32 count)
+{
+    // Keep track of usage statistics
+    self->allocations += count;
+    self->blocksInUse += count;
+    if (self->blocksInUse > self->maxBlocksInUse)
+    {
+        self->maxBlocksInUse = self->blocksInUse;
+    }
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FreeStats
+//----------------------------------------------------------------------------
+static void ALLOC_FreeStats(ALLOC_Allocator* self, UINT32 count)
+{
+    // Keep track of usage statistics
+    self->deallocations += count;
+    self->blocksInUse -= count;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FailStats
+//----------------------------------------------------------------------------
+static void ALLOC_FailStats(ALLOC_Allocator* self)
+{
+    ALLOC_LOCK(self);
+    self->failedAllocations++;
+    ALLOC_UNLOCK(self);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_ReadStats
+//----------------------------------------------------------------------------
+static void ALLOC_ReadStats(ALLOC_Allocator* self, ALLOC_Stats* pStats)
+{
+    // Copy the statistics while holding the lock for a consistent snapshot
+    ALLOC_LOCK(self);
+    pStats->blocksInUse = self->blocksInUse;
+    pStats->maxBlocksInUse = self->maxBlocksInUse;
+    pStats->allocations = self->allocations;
+    pStats->deallocations = self->deallocations;
+    pStats->failedAllocations = self->failedAllocations;
+    pStats->slabs = self->slabs;
+    ALLOC_UNLOCK(self);
+}
+#else
+//----------------------------------------------------------------------------
+// ALLOC_NewBlock
+//----------------------------------------------------------------------------
+static void* ALLOC_NewBlock(ALLOC_Allocator* self)
+{
+    UINT32 index;
+    char* pSlab = NULL;
+    char* pBlock;
+
+    // Atomically claim the next unused block within the pool. A slab is 
+    // chained before its first block is claimed, so a failed slab 
+    // allocation never uses up an index.
+    do
+    {
+        index = ATOMIC_Load32(&self->poolIndex);
+        if (index >= ALLOC_CAPACITY(self))
+            return NULL;
+
+        if (index >= self->maxBlocks)
+        {
+            pSlab = ALLOC_GetSlab(self, index / self->maxBlocks);
+            if (!pSlab)
+                return NULL;
+        }
+    } while (!ATOMIC_Cas32(&self->poolIndex, index, index + 1));
+
+    if (index < self->maxBlocks)
+        return (void*)(self->pPool + (index * self->blockSize));
+
+    // Get pointer to a new fixed memory block within a chained slab. The 
+    // block index + 1 is stored after the client's area for ALLOC_BlockIndex().
+    pBlock = pSlab + ((index % self->maxBlocks) * self->blockSize);
+    index++;
+    memcpy(pBlock + self->blockSize - ALLOC_INDEX_SIZE, &index, sizeof(index));
+
+    return (void*)pBlock;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_GetSlab
+//----------------------------------------------------------------------------
+static char* ALLOC_GetSlab(ALLOC_Allocator* self, UINT32 slab)
+{
+    void* volatile* ppSlab = (void* volatile*)&self->ppSlabs[slab];
+    char* pSlab = (char*)ATOMIC_LoadPtr(ppSlab);
+
+    // Chain a new slab the first time a block within it is needed. If 
+    // another thread installs the slab first, use theirs.
+    if (!pSlab)
+    {
+        pSlab = ALLOC_NewSlab(self);
+        if (pSlab && ATOMIC_CasPtr(ppSlab, NULL, pSlab))
+        {
+            ATOMIC_Add16(&self->slabs, 1);
+        }
+        else
+        {
+            if (pSlab)
+                ALLOC_FreeSlab(self, pSlab);
+            pSlab = (char*)ATOMIC_LoadPtr(ppSlab);
+        }
+    }
+
+    return pSlab;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_BlockIndex
+//----------------------------------------------------------------------------
+static UINT32 ALLOC_BlockIndex(ALLOC_Allocator* self, void* pBlock)
+{
+    UINT32 index;
+
+    // Free-list links are the block index + 1 across all slabs so that 0 
+    // marks the end of list. A static pool block's index is its position.
+    if ((char*)pBlock >= self->pPool && 
+        (char*)pBlock < self->pPool + (self->maxBlocks * self->blockSize))
+        return (UINT32)(((char*)pBlock - self->pPool) / self->blockSize) + 1;
+
+    // A slab block's index + 1 was stored by ALLOC_NewBlock()
+    ASSERT_TRUE(self->maxSlabs);
+    memcpy(&index, (char*)pBlock + self->blockSize - ALLOC_INDEX_SIZE, sizeof(index));
+
+    // Block not owned by this allocator?
+    ASSERT_TRUE(index > self->maxBlocks && index <= ALLOC_CAPACITY(self));
+    return index;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_IndexBlock
+//----------------------------------------------------------------------------
+static void* ALLOC_IndexBlock(ALLOC_Allocator* self, UINT32 index)
+{
+    char* pSlab;
+
+    // Convert a free-list index + 1 back into a block pointer. Returns NULL
+    // for an index outside the allocator, as can be read from a stale link.
+    if (!index || index > ALLOC_CAPACITY(self))
+        return NULL;
+
+    index--;
+    if (index < self->maxBlocks)
+        return (void*)(self->pPool + (index * self->blockSize));
+
+    pSlab = (char*)ATOMIC_LoadPtr((void* volatile*)&self->ppSlabs[index / self->maxBlocks]);
+    if (!pSlab)
+        return NULL;
+
+    return (void*)(pSlab + ((index % self->maxBlocks) * self->blockSize));
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_PopBulk
+//----------------------------------------------------------------------------
+static UINT32 ALLOC_PopBulk(ALLOC_Allocator* self, void** blocks, UINT32 count)
+{
+    UINT64 head;
+    UINT32 index;
+    UINT32 popped;
+
+    do
+    {
+        head = ATOMIC_Load64(&self->freeHead);
+
+        // Walk up to count blocks from the head. If another thread changes the 
+        // free-list meanwhile the links read may be stale, but the tag then 
+        // differs and the CAS retries. Stop on an out of range stale link.
+        popped = 0;
+        index = ALLOC_HEAD_INDEX(head);
+        while (popped < count && (blocks[popped] = ALLOC_IndexBlock(self, index)) != NULL)
+        {
+            index = ALLOC_NEXT_INDEX(blocks[popped]);
+            popped++;
+        }
+
+        if (!popped)
+            return 0;
+
+        // Detach the whole chain with one CAS
+    } while (!ATOMIC_Cas64(&self->freeHead, head,
+        ALLOC_HEAD_MAKE(ALLOC_HEAD_TAG(head) + 1, index)));
+
+    return popped;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_PushBulk
+//----------------------------------------------------------------------------
+static void ALLOC_PushBulk(ALLOC_Allocator* self, void** blocks, UINT32 count)
+{
+    UINT64 head;
+    UINT32 i;
+
+    if (!count)
+        return;
+
+    // Pre-link the blocks into a chain
+    for (i = 0; i + 1 < count; i++)
+        ALLOC_NEXT_INDEX(blocks[i]) = ALLOC_BlockIndex(self, blocks[i + 1]);
+
+    do
+    {
+        head = ATOMIC_Load64(&self->freeHead);
+
+        // Point the chain tail to the current head
+        ALLOC_NEXT_INDEX(blocks[count - 1]) = ALLOC_HEAD_INDEX(head);
+
+        // Make the chain head the new free-list head with one CAS
+    } while (!ATOMIC_Cas64(&self->freeHead, head,
+        ALLOC_HEAD_MAKE(ALLOC_HEAD_TAG(head) + 1, ALLOC_BlockIndex(self, blocks[0]))));
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_AllocStats
+//----------------------------------------------------------------------------
+static void ALLOC_AllocStats(ALLOC_Allocator* self, UINT32 count)
+{
+    UINT64 inUse;
+    UINT64 maxInUse;
+
+    // Keep track of usage statistics
+    ATOMIC_Add64(&self->allocations, count);
+    inUse = ATOMIC_Add64(&self->blocksInUse, count);
+    do
+    {
+        maxInUse = ATOMIC_Load64(&self->maxBlocksInUse);
+    } while (inUse > maxInUse && !ATOMIC_Cas64(&self->maxBlocksInUse, maxInUse, inUse));
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FreeStats
+//----------------------------------------------------------------------------
+static void ALLOC_FreeStats(ALLOC_Allocator* self, UINT32 count)
+{
+    // Keep track of usage statistics. Deallocations is counted last so a 
+    // snapshot never sees more deallocations than allocations.
+    ATOMIC_Add64(&self->blocksInUse, (UINT64)0 - count);
+    ATOMIC_Add64(&self->deallocations, count);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FailStats
+//----------------------------------------------------------------------------
+static void ALLOC_FailStats(ALLOC_Allocator* self)
+{
+    ATOMIC_Add64(&self->failedAllocations, 1);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_ReadStats
+//----------------------------------------------------------------------------
+static void ALLOC_ReadStats(ALLOC_Allocator* self, ALLOC_Stats* pStats)
+{
+    UINT64 allocations, deallocations, maxBlocksInUse, failedAllocations;
+
+    // Read every counter twice until both passes agree, so no counter 
+    // changed while the snapshot was taken. blocksInUse is derived from the 
+    // snapshot counters so that it always agrees with them.
+    do
+    {
+        allocations = ATOMIC_Load64(&self->allocations);
+        deallocations = ATOMIC_Load64(&self->deallocations);
+        maxBlocksInUse = ATOMIC_Load64(&self->maxBlocksInUse);
+        failedAllocations = ATOMIC_Load64(&self->failedAllocations);
+
+        pStats->allocations = ATOMIC_Load64(&self->allocations);
+        pStats->deallocations = ATOMIC_Load64(&self->deallocations);
+        pStats->maxBlocksInUse = ATOMIC_Load64(&self->maxBlocksInUse);
+        pStats->failedAllocations = ATOMIC_Load64(&self->failedAllocations);
+    } while (pStats->allocations != allocations || 
+        pStats->deallocations != deallocations ||
+        pStats->maxBlocksInUse != maxBlocksInUse ||
+        pStats->failedAllocations != failedAllocations);
+
+    pStats->blocksInUse = pStats->allocations - pStats->deallocations;
+
+    // An allocation raises the peak after counting itself, so the peak 
+    // read may still trail blocksInUse
+    if (pStats->maxBlocksInUse < pStats->blocksInUse)
+        pStats->maxBlocksInUse = pStats->blocksInUse;
+
+    pStats->slabs = ATOMIC_Load16(&self->slabs);
+}
+#endif // ALLOC_LOCK_FREE
+
+//----------------------------------------------------------------------------
+// ALLOC_SharedAlloc
+//----------------------------------------------------------------------------
+static UINT32 ALLOC_SharedAlloc(ALLOC_Allocator* self, void** blocks, UINT32 count)
+{
+    UINT32 allocated;
+
+    ALLOC_LOCK(self);
+
+    // Get blocks from the free-list
+    allocated = ALLOC_PopBulk(self, blocks, count);
+
+    // If the free-list is empty, get new blocks from the pool
+    while (allocated < count && (blocks[allocated] = ALLOC_NewBlock(self)) != NULL)
+        allocated++;
+
+    if (allocated)
+    {
+        ALLOC_AllocStats(self, allocated);
+    }
+
+    ALLOC_UNLOCK(self);
+
+    return allocated;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_SharedFree
+//----------------------------------------------------------------------------
+static void ALLOC_SharedFree(ALLOC_Allocator* self, void** blocks, UINT32 count)
+{
+    ALLOC_LOCK(self);
+
+    // Push the blocks onto a stack (i.e. the free-list)
+    ALLOC_PushBulk(self, blocks, count);
+
+    ALLOC_FreeStats(self, count);
+
+    ALLOC_UNLOCK(self);
+}
+
+#ifdef ALLOC_THREAD_CACHE
+//----------------------------------------------------------------------------
+// ALLOC_FlushCache
+//----------------------------------------------------------------------------
+static void ALLOC_FlushCache(ALLOC_ThreadCache* pCache)
+{
+    ALLOC_Allocator* pAllocator;
+    ALLOC_Magazine* pMagazine;
+    UINT32 count;
+
+    // Caller must hold _hLock
+
+    // Return the cached blocks to each allocator. The count is cleared 
+    // first so a statistics snapshot never counts a block twice.
+    for (pAllocator = _pAllocators; pAllocator; pAllocator = pAllocator->pNextAllocator)
+    {
+        if (!pAllocator->cacheIndex)
+            continue;
+
+        pMagazine = &pCache->magazines[pAllocator->cacheIndex - 1];
+        count = pMagazine->count;
+        pMagazine->count = 0;
+        ALLOC_SharedFree(pAllocator, pMagazine->blocks, count);
+    }
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_ThreadExit
+//----------------------------------------------------------------------------
+#if defined(_WIN32)
+static VOID WINAPI ALLOC_ThreadExit(PVOID pValue)
+#else
+static void ALLOC_ThreadExit(void* pValue)
+#endif
+{
+    ALLOC_ThreadCache* pCache = (ALLOC_ThreadCache*)pValue;
+    ALLOC_ThreadCache** ppCache;
+
+    if (!pCache)
+        return;
+
+    LK_LOCK(_hLock);
+
+    // Return the exiting thread's cached blocks, then unregister its cache
+    ALLOC_FlushCache(pCache);
+    for (ppCache = &_pThreadCaches; *ppCache; ppCache = &(*ppCache)->pNext)
+    {
+        if (*ppCache == pCache)
+        {
+            *ppCache = pCache->pNext;
+            break;
+        }
+    }
+    pCache->registered = FALSE;
+
+    LK_UNLOCK(_hLock);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_GetThreadCache
+//----------------------------------------------------------------------------
+static ALLOC_ThreadCache* ALLOC_GetThreadCache(void)
+{
+    // Register the calling thread's cache on first use
+    if (!_threadCache.registered)
+    {
+        LK_LOCK(_hLock);
+        _threadCache.pNext = _pThreadCaches;
+        _pThreadCaches = &_threadCache;
+        _threadCache.registered = TRUE;
+        LK_UNLOCK(_hLock);
+
+        // Flush the cache when the thread exits
+#if defined(_WIN32)
+        FlsSetValue(_exitKey, &_threadCache);
+#else
+        pthread_setspecific(_exitKey, &_threadCache);
+#endif
+    }
+
+    return &_threadCache;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_CacheAlloc
+//----------------------------------------------------------------------------
+static void* ALLOC_CacheAlloc(ALLOC_Allocator* self)
+{
+    ALLOC_Magazine* pMagazine = &ALLOC_GetThreadCache()->magazines[self->cacheIndex - 1];
+
+    // Refill an empty magazine from the shared allocator
+    if (!pMagazine->count)
+        pMagazine->count = ALLOC_SharedAlloc(self, pMagazine->blocks, ALLOC_MAGAZINE_SIZE / 2);
+
+    if (!pMagazine->count)
+        return NULL;
+
+    return pMagazine->blocks[--pMagazine->count];
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_CacheFree
+//----------------------------------------------------------------------------
+static void ALLOC_CacheFree(ALLOC_Allocator* self, void* pBlock)
+{
+    ALLOC_Magazine* pMagazine = &ALLOC_GetThreadCache()->magazines[self->cacheIndex - 1];
+
+    // Return half of a full magazine to the shared allocator
+    if (pMagazine->count == ALLOC_MAGAZINE_SIZE)
+    {
+        pMagazine->count = ALLOC_MAGAZINE_SIZE / 2;
+        ALLOC_SharedFree(self, &pMagazine->blocks[ALLOC_MAGAZINE_SIZE / 2], ALLOC_MAGAZINE_SIZE / 2);
+    }
+
+    pMagazine->blocks[pMagazine->count++] = pBlock;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_CachedBlocks
+//----------------------------------------------------------------------------
+static UINT64 ALLOC_CachedBlocks(ALLOC_Allocator* self)
+{
+    ALLOC_ThreadCache* pCache;
+    UINT64 cached = 0;
+
+    // Caller must hold _hLock
+    if (self->cacheIndex)
+    {
+        for (pCache = _pThreadCaches; pCache; pCache = pCache->pNext)
+            cached += pCache->magazines[self->cacheIndex - 1].count;
+    }
+    return cached;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FlushThreadCache
+//----------------------------------------------------------------------------
+void ALLOC_FlushThreadCache(void)
+{
+    LK_LOCK(_hLock);
+
+    // Return the calling thread's cached blocks to each allocator
+    if (_threadCache.registered)
+        ALLOC_FlushCache(&_threadCache);
+
+    LK_UNLOCK(_hLock);
+}
+#endif // ALLOC_THREAD_CACHE
+
 //----------------------------------------------------------------------------
 // ALLOC_Init
 //----------------------------------------------------------------------------
 void ALLOC_Init()
 {
     _hLock = LK_CREATE();
+
+#ifdef ALLOC_THREAD_CACHE
+    // Flush each thread's cache when it exits
+#if defined(_WIN32)
+    _exitKey = FlsAlloc(ALLOC_ThreadExit);
+    ASSERT_TRUE(_exitKey != FLS_OUT_OF_INDEXES);
+#else
+    ASSERT_TRUE(pthread_key_create(&_exitKey, ALLOC_ThreadExit) == 0);
+#endif
+#endif
 } 
 
 //----------------------------------------------------------------------------
@@ -116,13 +806,115 @@ void ALLOC_Init()
 //----------------------------------------------------------------------------
 void ALLOC_Term()
 {
+    ALLOC_Allocator* pAllocator = _pAllocators;
+    ALLOC_Allocator* pNextAllocator = NULL;
+    UINT16 slab;
+#ifdef ALLOC_THREAD_CACHE
+    ALLOC_ThreadCache* pCache;
+#endif
+
+#ifdef ALLOC_THREAD_CACHE
+    // Threads exiting from now on have nothing to return
+#if defined(_WIN32)
+    FlsFree(_exitKey);
+    _exitKey = FLS_OUT_OF_INDEXES;
+#else
+    pthread_key_delete(_exitKey);
+#endif
+#endif
+
+    // Destroy the lock of each registered allocator
+    while (pAllocator)
+    {
+        // Release any slabs chained by a growable allocator
+        for (slab = 1; slab <= pAllocator->maxSlabs; slab++)
+        {
+            if (pAllocator->ppSlabs[slab])
+            {
+                ALLOC_FreeSlab(pAllocator, pAllocator->ppSlabs[slab]);
+                pAllocator->ppSlabs[slab] = NULL;
+            }
+        }
+        pAllocator->slabs = 0;
+
+        // Return the allocator to its unused state so it starts over if
+        // ALLOC_Init() is called again
+        pAllocator->pHead = NULL;
+        pAllocator->poolIndex = 0;
+        pAllocator->blocksInUse = 0;
+        pAllocator->maxBlocksInUse = 0;
+        pAllocator->allocations = 0;
+        pAllocator->deallocations = 0;
+        pAllocator->failedAllocations = 0;
+#ifdef ALLOC_LOCK_FREE
+        pAllocator->freeHead = 0;
+#endif
+#ifdef ALLOC_THREAD_CACHE
+        pAllocator->cacheIndex = 0;
+#endif
+
+        ALLOC_LOCK_DESTROY(pAllocator);
+        pAllocator->hLock = NULL;
+        pNextAllocator = pAllocator->pNextAllocator;
+        pAllocator->pNextAllocator = NULL;
+        pAllocator = pNextAllocator;
+    }
+    _pAllocators = NULL;
+
+#ifdef ALLOC_THREAD_CACHE
+    // Discard the blocks cached by each live thread, since the pools were 
+    // reset. A thread registers its cache again on its next allocation.
+    for (pCache = _pThreadCaches; pCache; pCache = pCache->pNext)
+    {
+        memset(pCache->magazines, 0, sizeof(pCache->magazines));
+        pCache->registered = FALSE;
+    }
+    _pThreadCaches = NULL;
+    _cachedAllocators = 0;
+#endif
+
     LK_DESTROY(_hLock);
 }
 
 //----------------------------------------------------------------------------
-// ALLOC_Alloc
+// ALLOC_Register
 //----------------------------------------------------------------------------
-void* ALLOC_Alloc(ALLOC_HANDLE hAlloc, size_t size)
+void ALLOC_Register(ALLOC_HANDLE hAlloc)
+{
+    ALLOC_Allocator* self = NULL;
+
+    ASSERT_TRUE(hAlloc);
+
+    // Convert handle to an ALLOC_Allocator instance
+    self = (ALLOC_Allocator*)hAlloc;
+
+    LK_LOCK(_hLock);
+
+    // Only register an allocator instance once
+    if (!self->hLock)
+    {
+#ifdef ALLOC_THREAD_CACHE
+        // Assign a thread cache magazine, if any remain
+        if (_cachedAllocators < ALLOC_MAX_CACHED_ALLOCATORS)
+            self->cacheIndex = ++_cachedAllocators;
+#endif
+
+        // Add allocator instance to the registered list
+        self->pNextAllocator = _pAllocators;
+        _pAllocators = self;
+
+        // Create the allocator instance lock last. Other threads see the 
+        // allocator as registered once the lock is published.
+        ATOMIC_CasPtr((void* volatile*)&self->hLock, NULL, ALLOC_LOCK_CREATE(self));
+    }
+
+    LK_UNLOCK(_hLock);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_TryAlloc
+//----------------------------------------------------------------------------
+void* ALLOC_TryAlloc(ALLOC_HANDLE hAlloc, size_t size)
 {
     ALLOC_Allocator* self = NULL;
     void* pBlock = NULL;
@@ -133,32 +925,42 @@ void* ALLOC_Alloc(ALLOC_HANDLE hAlloc, size_t size)
     self = (ALLOC_Allocator*)hAlloc;
 
     // Ensure requested size fits within memory block 
-    ASSERT_TRUE(size <= self->blockSize);
+    ASSERT_TRUE(size <= ALLOC_USABLE_SIZE(self));
 
-    // Get a block from the free-list
-    pBlock = ALLOC_Pop(self);
+    // Register the allocator instance on first use
+    if (!ALLOC_REGISTERED(self))
+        ALLOC_Register(self);
 
-    // If the free-list empty?
-    if (!pBlock)
-    {
-        // Get a new block from the pool
-        pBlock = ALLOC_NewBlock(self);
-    }
+#ifdef ALLOC_THREAD_CACHE
+    if (self->cacheIndex)
+        pBlock = ALLOC_CacheAlloc(self);
+    else
+#endif
+        ALLOC_SharedAlloc(self, &pBlock, 1);
 
-    if (pBlock)
-    {
-        // Keep track of usage statistics
-        self->allocations++;
-        self->blocksInUse++;
-        if (self->blocksInUse > self->maxBlocksInUse)
-        {
-            self->maxBlocksInUse = self->blocksInUse;
-        }
-    }
+    // Out of fixed block memory
+    if (!pBlock)
+        ALLOC_FailStats(self);
 
     return GET_CLIENT_PTR(pBlock);
 } 
 
+//----------------------------------------------------------------------------
+// ALLOC_Alloc
+//----------------------------------------------------------------------------
+void* ALLOC_Alloc(ALLOC_HANDLE hAlloc, size_t size)
+{
+    void* pBlock = ALLOC_TryAlloc(hAlloc, size);
+
+#ifndef ALLOC_RETURN_NULL
+    // Out of fixed block memory
+    if (!pBlock)
+        ASSERT();
+#endif
+
+    return pBlock;
+} 
+
 //----------------------------------------------------------------------------
 // ALLOC_Calloc
 //----------------------------------------------------------------------------
@@ -202,13 +1004,160 @@ void ALLOC_Free(ALLOC_HANDLE hAlloc, void* pBlock)
     // Get a pointer to the block
     pBlock = GET_BLOCK_PTR(pBlock);
 
-    // Push the block onto a stack (i.e. the free-list)
-    ALLOC_Push(self, pBlock);
+#ifdef ALLOC_THREAD_CACHE
+    if (self->cacheIndex)
+        ALLOC_CacheFree(self, pBlock);
+    else
+#endif
+        ALLOC_SharedFree(self, &pBlock, 1);
+}
 
-    // Keep track of usage statistics
-    self->deallocations++;
-    self->blocksInUse--;
-} 
+//----------------------------------------------------------------------------
+// ALLOC_AllocBulk
+//----------------------------------------------------------------------------
+UINT32 ALLOC_AllocBulk(ALLOC_HANDLE hAlloc, size_t size, void** blocks, UINT32 count)
+{
+    ALLOC_Allocator* self = NULL;
+    UINT32 allocated = 0;
+
+    ASSERT_TRUE(hAlloc);
+    ASSERT_TRUE(blocks || !count);
+
+    // Convert handle to an ALLOC_Allocator instance
+    self = (ALLOC_Allocator*)hAlloc;
+
+    // Ensure requested size fits within memory block 
+    ASSERT_TRUE(size <= ALLOC_USABLE_SIZE(self));
+
+    // Register the allocator instance on first use
+    if (!ALLOC_REGISTERED(self))
+        ALLOC_Register(self);
+
+    // Bypass any thread cache. The blocks come from the shared allocator in 
+    // one batch, and may be freed individually or in bulk.
+    if (count)
+        allocated = ALLOC_SharedAlloc(self, blocks, count);
+
+    // Out of fixed block memory? Return the number allocated to the caller.
+    if (allocated < count)
+        ALLOC_FailStats(self);
+
+    return allocated;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FreeBulk
+//----------------------------------------------------------------------------
+void ALLOC_FreeBulk(ALLOC_HANDLE hAlloc, void** blocks, UINT32 count)
+{
+    ASSERT_TRUE(hAlloc);
+    ASSERT_TRUE(blocks || !count);
+
+    // Push every block onto the free-list at once
+    if (count)
+        ALLOC_SharedFree((ALLOC_Allocator*)hAlloc, blocks, count);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_OwnsBlock
+//----------------------------------------------------------------------------
+BOOL ALLOC_OwnsBlock(ALLOC_HANDLE hAlloc, const void* pBlock)
+{
+    ALLOC_Allocator* self = NULL;
+    size_t slabSize = 0;
+    const char* pSlab = NULL;
+    UINT16 slab = 0;
+
+    ASSERT_TRUE(hAlloc);
+
+    // Cast handle to an allocator instance
+    self = (ALLOC_Allocator*)hAlloc;
+    slabSize = self->maxBlocks * self->blockSize;
 
+    // Is the block within the static pool or any chained slab?
+    for (slab = 0; slab <= self->maxSlabs; slab++)
+    {
+        pSlab = slab ? self->ppSlabs[slab] : self->pPool;
+        if (pSlab && (const char*)pBlock >= pSlab && (const char*)pBlock < pSlab + slabSize)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_Snapshot
+//----------------------------------------------------------------------------
+static void ALLOC_Snapshot(ALLOC_Allocator* self, ALLOC_Stats* pStats)
+{
+#ifdef ALLOC_THREAD_CACHE
+    UINT64 cached;
+#endif
 
+    // Caller must hold _hLock
+    pStats->name = self->name;
+    pStats->blockSize = self->blockSize;
+    pStats->maxBlocks = ALLOC_CAPACITY(self);
+    pStats->maxSlabs = self->maxSlabs;
+    ALLOC_ReadStats(self, pStats);
+    pStats->blocks = self->maxBlocks * ((UINT32)pStats->slabs + 1);
 
+#ifdef ALLOC_THREAD_CACHE
+    // Blocks held within thread caches are free, not in use. Caches change
+    // while the snapshot is taken, so never report more than were handed out.
+    cached = ALLOC_CachedBlocks(self);
+    if (cached > pStats->blocksInUse)
+        cached = pStats->blocksInUse;
+    pStats->blocksInUse -= cached;
+    pStats->blocksCached = cached;
+#else
+    pStats->blocksCached = 0;
+#endif
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_GetAllocatorStats
+//----------------------------------------------------------------------------
+void ALLOC_GetAllocatorStats(ALLOC_HANDLE hAlloc, ALLOC_Stats* pStats)
+{
+    ALLOC_Allocator* self = NULL;
+
+    ASSERT_TRUE(hAlloc);
+    ASSERT_TRUE(pStats);
+
+    // Cast handle to an allocator instance
+    self = (ALLOC_Allocator*)hAlloc;
+
+    // Register the allocator instance on first use
+    if (!ALLOC_REGISTERED(self))
+        ALLOC_Register(self);
+
+    LK_LOCK(_hLock);
+    ALLOC_Snapshot(self, pStats);
+    LK_UNLOCK(_hLock);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_GetStats
+//----------------------------------------------------------------------------
+UINT16 ALLOC_GetStats(ALLOC_Stats* pStats, UINT16 maxStats)
+{
+    ALLOC_Allocator* pAllocator;
+    UINT16 count = 0;
+
+    ASSERT_TRUE(pStats || !maxStats);
+
+    LK_LOCK(_hLock);
+
+    // Snapshot each registered allocator without blocking alloc/free calls 
+    // on the other allocators
+    for (pAllocator = _pAllocators; pAllocator && count < maxStats; 
+        pAllocator = pAllocator->pNextAllocator)
+    {
+        ALLOC_Snapshot(pAllocator, &pStats[count++]);
+    }
+
+    LK_UNLOCK(_hLock);
+
+    return count;
+}
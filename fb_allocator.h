@@ -4,8 +4,20 @@
 // single block size. 
 //
 // Create an allocator instance using the ALLOC_DEFINE macro. Call 
-// ALLOC_Init() one time at startup. ALLOC_Alloc() allocates a fixed 
-// memory block. ALLOC_Free() frees the block. 
+// ALLOC_Init() one time at startup. ALLOC_Alloc() allocates a fixed memory
+// block. ALLOC_TryAlloc() does the same but always returns NULL when out of
+// blocks, whether or not ALLOC_RETURN_NULL is defined. ALLOC_Free() frees 
+// the block. Each allocator instance has its own lock, so allocators never
+// contend with one another. The lock is created when the allocator is 
+// registered, either on first use or by calling ALLOC_Register() up front,
+// e.g. from a single thread at startup.
+//
+// ALLOC_AllocBulk() and ALLOC_FreeBulk() move many blocks with a single 
+// lock acquisition (or a single CAS with ALLOC_LOCK_FREE).
+//
+// ALLOC_GetStats() copies a snapshot of the 64-bit usage counters of every 
+// registered allocator, and may be called at any time while other threads 
+// allocate and free.
 //
 // #include "fb_allocator.h"
 // ALLOC_DEFINE(myAllocator, 32, 5)
@@ -23,11 +35,37 @@
 
 #include <stdlib.h>
 #include "DataTypes.h"
+#include "LockGuard.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Define ALLOC_LOCK_FREE to replace the per-allocator lock with a lock-free 
+// free-list (an ABA-safe Treiber stack) and an atomic pool bump index.
+// #define ALLOC_LOCK_FREE
+
+// Define ALLOC_RETURN_NULL to have ALLOC_Alloc() return NULL when an 
+// allocator is out of blocks instead of asserting. Each failure is counted
+// as a failedAllocations statistic.
+// #define ALLOC_RETURN_NULL
+
+// Define ALLOC_THREAD_CACHE to place a per-thread cache (magazine) of free
+// blocks in front of each allocator. Blocks move between a thread's magazine
+// and the shared allocator ALLOC_MAGAZINE_SIZE / 2 at a time, so most 
+// alloc/free calls touch only thread-local memory. Cached blocks are 
+// reported as blocksCached rather than blocksInUse. A thread's cached blocks
+// are returned to the shared allocator when the thread exits, or earlier by
+// calling ALLOC_FlushThreadCache().
+// #define ALLOC_THREAD_CACHE
+#ifdef ALLOC_THREAD_CACHE
+    // Maximum number of blocks cached per thread per allocator
+    #define ALLOC_MAGAZINE_SIZE             16
+
+    // Maximum number of registered allocators that use a thread cache
+    #define ALLOC_MAX_CACHED_ALLOCATORS     8
+#endif
+
 typedef void* ALLOC_HANDLE;
 
 typedef struct 
@@ -35,22 +73,61 @@ typedef struct
     void* pNext;
 } ALLOC_Block;
 
-// Use ALLOC_DEFINE to declare an ALLOC_Allocator object
-typedef struct
+// Use ALLOC_DEFINE, ALLOC_DEFINE_GROW, ALLOC_DEFINE_ALIGNED or 
+// ALLOC_DEFINE_GROW_ALIGNED to declare an ALLOC_Allocator object
+typedef struct ALLOC_Allocator
 {
     const char* name;
     const char* pPool;
     const size_t objectSize;
     const size_t blockSize;
     const UINT32 maxBlocks;
+    const UINT16 alignment;
+    const UINT16 alignOffset;
     ALLOC_Block* pHead;
-    UINT16 poolIndex;
-    UINT16 blocksInUse;
-    UINT16 maxBlocksInUse;
-    UINT16 allocations;
-    UINT16 deallocations;
+    UINT32 poolIndex;
+    UINT64 blocksInUse;
+    UINT64 maxBlocksInUse;
+    UINT64 allocations;
+    UINT64 deallocations;
+    UINT64 failedAllocations;
+    char** ppSlabs;
+    const UINT16 maxSlabs;
+    UINT16 slabs;
+    LOCK_HANDLE hLock;
+    struct ALLOC_Allocator* pNextAllocator;
+#ifdef ALLOC_LOCK_FREE
+    // Free-list head used instead of pHead. The low 32-bits hold the head 
+    // block index + 1 (0 is empty) and the high 32-bits an ABA tag. 
+    UINT64 freeHead;
+#endif
+#ifdef ALLOC_THREAD_CACHE
+    // Thread cache magazine index + 1 (0 is not cached)
+    UINT16 cacheIndex;
+#endif
+#ifdef LK_SPIN_LOCK
+    // Inline storage for the lock referenced by hLock
+    LK_SpinLock lock;
+#endif
 } ALLOC_Allocator;
 
+// A snapshot of one allocator's usage statistics. See ALLOC_GetStats().
+typedef struct
+{
+    const char* name;
+    size_t blockSize;
+    UINT32 blocks;              // Including the slabs chained so far
+    UINT32 maxBlocks;           // Including all slabs of a growable allocator
+    UINT16 slabs;               // Slabs chained beyond the static pool
+    UINT16 maxSlabs;
+    UINT64 blocksInUse;
+    UINT64 blocksCached;        // Free blocks held within thread caches
+    UINT64 maxBlocksInUse;
+    UINT64 allocations;
+    UINT64 deallocations;
+    UINT64 failedAllocations;
+} ALLOC_Stats;
+
 // Align fixed blocks on X-byte boundary based on CPU architecture.
 // Set value to 1, 2, 4 or 8.
 #define ALLOC_MEM_ALIGN   (1)
@@ -60,13 +137,26 @@ typedef struct
 
 // Round _numToRound_ to the next higher _multiple_
 #define ALLOC_ROUND_UP(_numToRound_, _multiple_) \
-    (((_numToRound_ + _multiple_ - 1) / _multiple_) * _multiple_)
+    ((((_numToRound_) + (_multiple_) - 1) / (_multiple_)) * (_multiple_))
 
 // Ensure the memory block size is: (a) is aligned on desired boundary and (b) at
 // least the size of a ALLOC_Allocator*. 
 #define ALLOC_BLOCK_SIZE(_size_) \
     (ALLOC_MAX((ALLOC_ROUND_UP(_size_, ALLOC_MEM_ALIGN)), sizeof(ALLOC_Allocator*)))
 
+// With ALLOC_LOCK_FREE each block of a growable allocator ends with its 
+// index, so a freed block is linked into the free-list without searching
+// the slabs. The index is outside the client's area.
+#ifdef ALLOC_LOCK_FREE
+    #define ALLOC_INDEX_SIZE    sizeof(UINT32)
+#else
+    #define ALLOC_INDEX_SIZE    0
+#endif
+
+// Number of bytes within each block of _alloc_ available to the client
+#define ALLOC_USABLE_SIZE(_alloc_) \
+    ((_alloc_)->blockSize - ((_alloc_)->maxSlabs ? ALLOC_INDEX_SIZE : 0))
+
 // Defines block memory, allocator instance and a handle. On the example below, 
 // the ALLOC_Allocator instance is myAllocatorObj and the handle is myAllocator.
 // _name_ - the allocator name
@@ -76,14 +166,107 @@ typedef struct
 #define ALLOC_DEFINE(_name_, _size_, _objects_) \
     static char _name_##Memory[ALLOC_BLOCK_SIZE(_size_) * (_objects_)] = { 0 }; \
     static ALLOC_Allocator _name_##Obj = { #_name_, _name_##Memory, _size_, \
-        ALLOC_BLOCK_SIZE(_size_), _objects_, NULL, 0, 0, 0, 0, 0 }; \
+        ALLOC_BLOCK_SIZE(_size_), _objects_, ALLOC_MEM_ALIGN, 0, NULL, 0, 0, 0, 0, 0, 0, NULL, 0, 0, NULL, NULL }; \
+    static ALLOC_HANDLE _name_ = &_name_##Obj;
+
+// Defines a growable allocator. When the static pool is exhausted, up to 
+// _maxSlabs_ additional slabs of _objects_ blocks each are chained using 
+// ALLOC_SLAB_ALLOC. Slabs are only released by ALLOC_Term(). The slabs 
+// chained so far are reported by ALLOC_GetStats().
+// _name_ - the allocator name
+// _size_ - fixed memory block size in bytes
+// _objects_ - number of fixed memory blocks per slab
+// _maxSlabs_ - maximum number of slabs added beyond the static pool
+// e.g. ALLOC_DEFINE_GROW(myAllocator, 32, 10, 4)
+#define ALLOC_DEFINE_GROW(_name_, _size_, _objects_, _maxSlabs_) \
+    static char _name_##Memory[ALLOC_BLOCK_SIZE((_size_) + ALLOC_INDEX_SIZE) * (_objects_)] = { 0 }; \
+    static char* _name_##Slabs[(_maxSlabs_) + 1] = { _name_##Memory }; \
+    static ALLOC_Allocator _name_##Obj = { #_name_, _name_##Memory, _size_, \
+        ALLOC_BLOCK_SIZE((_size_) + ALLOC_INDEX_SIZE), _objects_, ALLOC_MEM_ALIGN, 0, NULL, 0, 0, 0, 0, 0, 0, _name_##Slabs, \
+        _maxSlabs_, 0, NULL, NULL }; \
+    static ALLOC_HANDLE _name_ = &_name_##Obj;
+
+// Declare a variable aligned on an _align_ byte boundary. _align_ must be a 
+// literal power of two.
+#if defined(_MSC_VER)
+    #define ALLOC_ALIGNAS(_align_)  __declspec(align(_align_))
+#else
+    #define ALLOC_ALIGNAS(_align_)  __attribute__((aligned(_align_)))
+#endif
+
+// Size of a block holding an _offset_ byte header followed by client data 
+// aligned on an _align_ byte boundary. The header and the client data are 
+// each rounded up to a multiple of _align_, so the client data never shares
+// a cache line with another block.
+#define ALLOC_BLOCK_SIZE_ALIGNED(_size_, _align_, _offset_) \
+    (ALLOC_MAX(ALLOC_ROUND_UP((_size_) - (_offset_), (_align_)) + \
+        ALLOC_ROUND_UP((_offset_), (_align_)), sizeof(ALLOC_Allocator*)))
+
+// Defines the block memory and ALLOC_Allocator instance of an allocator 
+// whose blocks start _offset_ bytes before an _align_ byte boundary. No 
+// handle is defined. Use ALLOC_DEFINE_ALIGNED instead unless the block 
+// holds a header ahead of the client data.
+#define _ALLOC_DEFINE_ALIGNED(_name_, _size_, _objects_, _align_, _offset_) \
+    static ALLOC_ALIGNAS(_align_) char _name_##Memory[ALLOC_BLOCK_SIZE_ALIGNED(_size_, _align_, _offset_) * \
+        (_objects_) + (_align_)] = { 0 }; \
+    static ALLOC_Allocator _name_##Obj = { #_name_, \
+        _name_##Memory + (((_align_) - (_offset_)) % (_align_)), _size_, \
+        ALLOC_BLOCK_SIZE_ALIGNED(_size_, _align_, _offset_), _objects_, _align_, _offset_, \
+        NULL, 0, 0, 0, 0, 0, 0, NULL, 0, 0, NULL, NULL };
+
+// Defines an allocator with each block aligned on an _align_ byte boundary 
+// (e.g. 16, 32 or 64). Block sizes are a multiple of _align_, so a block no 
+// larger than a cache line never straddles two cache lines or shares one 
+// with another block. 
+// _name_ - the allocator name
+// _size_ - fixed memory block size in bytes
+// _objects_ - number of fixed memory blocks 
+// _align_ - block alignment in bytes. Must be a literal power of two.
+// e.g. ALLOC_DEFINE_ALIGNED(myAllocator, 64, 10, 64)
+#define ALLOC_DEFINE_ALIGNED(_name_, _size_, _objects_, _align_) \
+    _ALLOC_DEFINE_ALIGNED(_name_, _size_, _objects_, _align_, 0) \
+    static ALLOC_HANDLE _name_ = &_name_##Obj;
+
+// Defines a growable allocator with each block aligned on an _align_ byte
+// boundary, within the static pool and within every chained slab. Block 
+// sizes are a multiple of _align_.
+// _name_ - the allocator name
+// _size_ - fixed memory block size in bytes
+// _objects_ - number of fixed memory blocks per slab
+// _maxSlabs_ - maximum number of slabs added beyond the static pool
+// _align_ - block alignment in bytes. Must be a literal power of two.
+// e.g. ALLOC_DEFINE_GROW_ALIGNED(myAllocator, 32, 10, 4, 32)
+#define ALLOC_DEFINE_GROW_ALIGNED(_name_, _size_, _objects_, _maxSlabs_, _align_) \
+    static ALLOC_ALIGNAS(_align_) char _name_##Memory[ALLOC_BLOCK_SIZE_ALIGNED((_size_) + ALLOC_INDEX_SIZE, \
+        _align_, 0) * (_objects_)] = { 0 }; \
+    static char* _name_##Slabs[(_maxSlabs_) + 1] = { _name_##Memory }; \
+    static ALLOC_Allocator _name_##Obj = { #_name_, _name_##Memory, _size_, \
+        ALLOC_BLOCK_SIZE_ALIGNED((_size_) + ALLOC_INDEX_SIZE, _align_, 0), _objects_, _align_, 0, \
+        NULL, 0, 0, 0, 0, 0, 0, _name_##Slabs, _maxSlabs_, 0, NULL, NULL }; \
     static ALLOC_HANDLE _name_ = &_name_##Obj;
 
+// Slab memory source for growable allocators. Redefine to use a reserved
+// arena instead of the heap.
+#ifndef ALLOC_SLAB_ALLOC
+    #define ALLOC_SLAB_ALLOC(_size_)    malloc(_size_)
+    #define ALLOC_SLAB_FREE(_ptr_)      free(_ptr_)
+#endif
+
 void ALLOC_Init(void);
 void ALLOC_Term(void);
+void ALLOC_Register(ALLOC_HANDLE hAlloc);
 void* ALLOC_Alloc(ALLOC_HANDLE hAlloc, size_t size);
+void* ALLOC_TryAlloc(ALLOC_HANDLE hAlloc, size_t size);
 void* ALLOC_Calloc(ALLOC_HANDLE hAlloc, size_t num, size_t size);
 void ALLOC_Free(ALLOC_HANDLE hAlloc, void* pBlock);
+UINT32 ALLOC_AllocBulk(ALLOC_HANDLE hAlloc, size_t size, void** blocks, UINT32 count);
+void ALLOC_FreeBulk(ALLOC_HANDLE hAlloc, void** blocks, UINT32 count);
+BOOL ALLOC_OwnsBlock(ALLOC_HANDLE hAlloc, const void* pBlock);
+void ALLOC_GetAllocatorStats(ALLOC_HANDLE hAlloc, ALLOC_Stats* pStats);
+UINT16 ALLOC_GetStats(ALLOC_Stats* pStats, UINT16 maxStats);
+#ifdef ALLOC_THREAD_CACHE
+void ALLOC_FlushThreadCache(void);
+#endif
 
 #ifdef __cplusplus
 }
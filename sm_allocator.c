@@ -1,37 +1,119 @@
 // SMALLOC allocates either a 32 or 128 byte block depending 
-// on the requested size. 
+// on the requested size. With SMALLOC_ALIGNED, SMALLOC_AllocAligned 
+// allocates a 64 byte cache line aligned block.
 
 #include "sm_allocator.h"
 #include "x_allocator.h"
+#include "Fault.h"
+#ifdef SMALLOC_PROFILE
+    #include "sm_profile.h"
+    #include <string.h>
+#endif
 
 // Maximum number of blocks for each size
 #define MAX_32_BLOCKS   10
 #define MAX_128_BLOCKS	5
+#ifdef SMALLOC_ALIGNED
+    #define MAX_ALIGNED_64_BLOCKS   4
+#endif
 
-// Define size of each block including meta data overhead
-#define BLOCK_32_SIZE     32 + XALLOC_BLOCK_META_DATA_SIZE
-#define BLOCK_128_SIZE    128 + XALLOC_BLOCK_META_DATA_SIZE
+// Maximum number of additional slabs of blocks each size can grow by 
+// before exhaustion
+#define MAX_32_SLABS    4
+#define MAX_128_SLABS   4
 
-// Define individual fb_allocators
-ALLOC_DEFINE(smDataAllocator32, BLOCK_32_SIZE, MAX_32_BLOCKS)
-ALLOC_DEFINE(smDataAllocator128, BLOCK_128_SIZE, MAX_128_BLOCKS)
+// Define individual fb_allocators. Each block holds the client size plus 
+// the block meta data overhead.
+XALLOC_DEFINE_GROW(smDataAllocator32, 32, MAX_32_BLOCKS, MAX_32_SLABS)
+XALLOC_DEFINE_GROW(smDataAllocator128, 128, MAX_128_BLOCKS, MAX_128_SLABS)
+#ifdef SMALLOC_ALIGNED
+XALLOC_DEFINE_ALIGNED(smDataAllocatorAligned64, 64, MAX_ALIGNED_64_BLOCKS, 64)
+#endif
 
 // An array of allocators sorted by smallest block first
 static ALLOC_Allocator* allocators[] = {
     &smDataAllocator32Obj,
-    &smDataAllocator128Obj
+    &smDataAllocator128Obj,
+#ifdef SMALLOC_ALIGNED
+    &smDataAllocatorAligned64Obj
+#endif
 };
 
 #define MAX_ALLOCATORS   (sizeof(allocators) / sizeof(allocators[0]))
 
-static XAllocData self = { allocators, MAX_ALLOCATORS };
+static XAllocData self = { allocators, MAX_ALLOCATORS, { 0 }, XALLOC_STATE_NONE };
+
+// Largest request size routed to a registered event data pool
+#define MAX_EVENT_POOL_SIZE     128
+
+// Event data pools registered using SMALLOC_Register(), indexed by the 
+// client size of their blocks
+static ALLOC_Allocator* _eventPools[MAX_EVENT_POOL_SIZE + 1];
+
+//----------------------------------------------------------------------------
+// SMALLOC_Init
+//----------------------------------------------------------------------------
+void SMALLOC_Init(void)
+{
+    XALLOC_Init(&self);
+#ifdef SMALLOC_PROFILE
+    SMPROF_Init();
+#endif
+}
 
 //----------------------------------------------------------------------------
 // SMALLOC_Alloc
 //----------------------------------------------------------------------------
 void* SMALLOC_Alloc(size_t size)
 {
-    return XALLOC_Alloc(&self, size);
+#ifdef SMALLOC_PROFILE
+    return SMPROF_Alloc(size);
+#else
+    void* pMem = NULL;
+
+    // Use an event data pool of exactly the requested size first. An 
+    // exhausted pool falls back to the size classes.
+    if (size <= MAX_EVENT_POOL_SIZE && _eventPools[size])
+        pMem = XALLOC_TryAllocFrom(_eventPools[size], size);
+
+    if (!pMem)
+        pMem = XALLOC_Alloc(&self, size);
+    return pMem;
+#endif
+}
+
+#ifdef SMALLOC_ALIGNED
+//----------------------------------------------------------------------------
+// SMALLOC_AllocAligned
+//----------------------------------------------------------------------------
+void* SMALLOC_AllocAligned(size_t size, size_t align)
+{
+#ifdef SMALLOC_PROFILE
+    return SMPROF_AllocAligned(size, align);
+#else
+    return XALLOC_AllocAligned(&self, size, align);
+#endif
+}
+#endif
+
+//----------------------------------------------------------------------------
+// SMALLOC_Register
+//----------------------------------------------------------------------------
+void SMALLOC_Register(ALLOC_HANDLE hAlloc)
+{
+    ALLOC_Allocator* pAllocator = (ALLOC_Allocator*)hAlloc;
+    size_t size;
+
+    ASSERT_TRUE(pAllocator);
+    ASSERT_TRUE(pAllocator->objectSize >= XALLOC_BLOCK_META_DATA_SIZE);
+
+    XALLOC_Register(pAllocator);
+
+    // Route requests of exactly the pool's client size to the pool. Call 
+    // at startup, before any thread allocates.
+    size = pAllocator->objectSize - XALLOC_BLOCK_META_DATA_SIZE;
+    if (size <= MAX_EVENT_POOL_SIZE && !_eventPools[size])
+        _eventPools[size] = pAllocator;
 }
 
 //----------------------------------------------------------------------------
@@ -39,7 +121,11 @@ void* SMALLOC_Alloc(size_t size)
 //----------------------------------------------------------------------------
 void SMALLOC_Free(void* ptr)
 {
+#ifdef SMALLOC_PROFILE
+    SMPROF_Free(ptr);
+#else
     XALLOC_Free(ptr);
+#endif
 }
 
 //----------------------------------------------------------------------------
@@ -47,7 +133,42 @@ void SMALLOC_Free(void* ptr)
 //----------------------------------------------------------------------------
 void* SMALLOC_Realloc(void *ptr, size_t new_size)
 {
+#ifdef SMALLOC_PROFILE
+    return SMPROF_Realloc(ptr, new_size);
+#else
     return XALLOC_Realloc(&self, ptr, new_size);
+#endif
+}
+
+//----------------------------------------------------------------------------
+// SMALLOC_AllocBulk
+//----------------------------------------------------------------------------
+UINT32 SMALLOC_AllocBulk(size_t size, void** ptrs, UINT32 count)
+{
+#ifdef SMALLOC_PROFILE
+    UINT32 i;
+
+    for (i = 0; i < count && (ptrs[i] = SMPROF_Alloc(size)) != NULL; i++)
+        ;
+    return i;
+#else
+    return XALLOC_AllocBulk(&self, size, ptrs, count);
+#endif
+}
+
+//----------------------------------------------------------------------------
+// SMALLOC_FreeBulk
+//----------------------------------------------------------------------------
+void SMALLOC_FreeBulk(void** ptrs, UINT32 count)
+{
+#ifdef SMALLOC_PROFILE
+    UINT32 i;
+
+    for (i = 0; i < count; i++)
+        SMPROF_Free(ptrs[i]);
+#else
+    XALLOC_FreeBulk(ptrs, count);
+#endif
 }
 
 //----------------------------------------------------------------------------
@@ -55,6 +176,14 @@ void* SMALLOC_Realloc(void *ptr, size_t new_size)
 //----------------------------------------------------------------------------
 void* SMALLOC_Calloc(size_t num, size_t size)
 {
+#ifdef SMALLOC_PROFILE
+    void* pMem = SMPROF_Alloc(num * size);
+
+    if (pMem)
+        memset(pMem, 0, num * size);
+    return pMem;
+#else
     return XALLOC_Calloc(&self, num, size);
+#endif
 }
 
@@ -2,13 +2,30 @@
 #define _SM_ALLOCATOR_H
 
 #include <stddef.h>
+#include "fb_allocator.h"
+
+// Define SMALLOC_PROFILE to forward every SMALLOC_ call to the SMPROF 
+// allocation profiler. Call SMPROF_Report() to write the recommended 
+// size classes for the observed workload. See sm_profile.h.
+// #define SMALLOC_PROFILE
+
+// Define SMALLOC_ALIGNED to add a pool of 64 byte, cache line aligned 
+// blocks allocated using SMALLOC_AllocAligned().
+// #define SMALLOC_ALIGNED
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+void SMALLOC_Init(void);
 void* SMALLOC_Alloc(size_t size);
+#ifdef SMALLOC_ALIGNED
+void* SMALLOC_AllocAligned(size_t size, size_t align);
+#endif
 void SMALLOC_Free(void* ptr);
+void SMALLOC_Register(ALLOC_HANDLE hAlloc);
+UINT32 SMALLOC_AllocBulk(size_t size, void** ptrs, UINT32 count);
+void SMALLOC_FreeBulk(void** ptrs, UINT32 count);
 void* SMALLOC_Realloc(void *ptr, size_t new_size);
 void* SMALLOC_Calloc(size_t num, size_t size);
 
@@ -0,0 +1,279 @@
+#include "sm_profile.h"
+#include "LockGuard.h"
+#include "Fault.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Usage statistics for one histogram bucket
+typedef struct
+{
+    UINT64 requests;
+    UINT32 live;
+    UINT32 peakLive;
+} SMPROF_Bucket;
+
+// Stored immediately before each client block
+typedef struct
+{
+    void* pRaw;
+    size_t size;
+} SMPROF_Header;
+
+static SMPROF_Bucket _buckets[SMPROF_BUCKETS];
+
+// Protects the histogram
+static LOCK_HANDLE _hLock;
+
+// Get the histogram bucket index of a requested size
+#define SMPROF_BUCKET(_size_) \
+    (((_size_) > SMPROF_MAX_SIZE) ? (SMPROF_BUCKETS - 1) : \
+    ((_size_) ? ((_size_) - 1) / SMPROF_GRANULE : 0))
+
+// Largest size recorded within a histogram bucket
+#define SMPROF_BUCKET_SIZE(_bucket_)    (((_bucket_) + 1) * SMPROF_GRANULE)
+
+//----------------------------------------------------------------------------
+// SMPROF_Init
+//----------------------------------------------------------------------------
+void SMPROF_Init(void)
+{
+    _hLock = LK_CREATE();
+    memset(_buckets, 0, sizeof(_buckets));
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_Term
+//----------------------------------------------------------------------------
+void SMPROF_Term(void)
+{
+    LK_DESTROY(_hLock);
+    _hLock = NULL;
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_AllocAligned
+//----------------------------------------------------------------------------
+void* SMPROF_AllocAligned(size_t size, size_t align)
+{
+    SMPROF_Bucket* pBucket = NULL;
+    SMPROF_Header* pHeader = NULL;
+    char* pRaw = NULL;
+    size_t client;
+
+    ASSERT_TRUE(align && !(align & (align - 1)));
+
+    // Over allocate for the header and the alignment padding
+    pRaw = (char*)malloc(sizeof(SMPROF_Header) + size + align - 1);
+    if (!pRaw)
+    {
+        ASSERT();
+        return NULL;
+    }
+
+    client = ((size_t)pRaw + sizeof(SMPROF_Header) + align - 1) & ~(align - 1);
+    pHeader = (SMPROF_Header*)client - 1;
+    pHeader->pRaw = pRaw;
+    pHeader->size = size;
+
+    // Record the request and the bucket's peak live blocks
+    pBucket = &_buckets[SMPROF_BUCKET(size)];
+    LK_LOCK(_hLock);
+    pBucket->requests++;
+    if (++pBucket->live > pBucket->peakLive)
+        pBucket->peakLive = pBucket->live;
+    LK_UNLOCK(_hLock);
+
+    return (void*)client;
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_Alloc
+//----------------------------------------------------------------------------
+void* SMPROF_Alloc(size_t size)
+{
+    return SMPROF_AllocAligned(size, sizeof(SMPROF_Header));
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_Free
+//----------------------------------------------------------------------------
+void SMPROF_Free(void* ptr)
+{
+    SMPROF_Header* pHeader = NULL;
+
+    if (!ptr)
+        return;
+
+    pHeader = (SMPROF_Header*)ptr - 1;
+
+    LK_LOCK(_hLock);
+    _buckets[SMPROF_BUCKET(pHeader->size)].live--;
+    LK_UNLOCK(_hLock);
+
+    free(pHeader->pRaw);
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_Realloc
+//----------------------------------------------------------------------------
+void* SMPROF_Realloc(void* ptr, size_t new_size)
+{
+    void* pNewMem = NULL;
+    size_t oldSize = 0;
+
+    if (!ptr)
+        return SMPROF_Alloc(new_size);
+
+    if (0 == new_size)
+    {
+        SMPROF_Free(ptr);
+        return NULL;
+    }
+
+    // Always move the block so each size is recorded as a new request
+    pNewMem = SMPROF_Alloc(new_size);
+    if (pNewMem)
+    {
+        oldSize = ((SMPROF_Header*)ptr - 1)->size;
+        memcpy(pNewMem, ptr, (oldSize < new_size) ? oldSize : new_size);
+        SMPROF_Free(ptr);
+    }
+
+    return pNewMem;
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_GetClasses
+//----------------------------------------------------------------------------
+UINT16 SMPROF_GetClasses(SMPROF_SizeClass* classes, UINT16 maxClasses)
+{
+    // Non-empty buckets in ascending size order
+    size_t sizes[SMPROF_BUCKETS];
+    UINT64 peaks[SMPROF_BUCKETS + 1];
+    UINT16 used = 0;
+
+    // bytes[k][j] is the least memory holding the first j buckets within k
+    // size classes. The last class of that solution starts at bucket first[k][j].
+    UINT64 bytes[SMPROF_MAX_CLASSES + 1][SMPROF_BUCKETS + 1];
+    UINT16 first[SMPROF_MAX_CLASSES + 1][SMPROF_BUCKETS + 1];
+
+    UINT16 numClasses;
+    UINT16 k, i, j;
+    UINT64 cost;
+
+    ASSERT_TRUE(classes || !maxClasses);
+
+    LK_LOCK(_hLock);
+
+    // Gather the sizes with a non-zero peak. peaks[] holds a running sum so
+    // the peak of any bucket range is a subtraction.
+    peaks[0] = 0;
+    for (i = 0; i < SMPROF_BUCKETS - 1; i++)
+    {
+        if (_buckets[i].peakLive)
+        {
+            sizes[used] = SMPROF_BUCKET_SIZE(i);
+            peaks[used + 1] = peaks[used] + _buckets[i].peakLive;
+            used++;
+        }
+    }
+
+    LK_UNLOCK(_hLock);
+
+    numClasses = maxClasses;
+    if (numClasses > SMPROF_MAX_CLASSES)
+        numClasses = SMPROF_MAX_CLASSES;
+    if (numClasses > used)
+        numClasses = used;
+    if (!numClasses)
+        return 0;
+
+    // A class covering buckets i..j-1 needs blocks of sizes[j-1] bytes, one
+    // for each live block at the bucket peaks
+    for (j = 1; j <= used; j++)
+    {
+        bytes[1][j] = sizes[j - 1] * (peaks[j] - peaks[0]);
+        first[1][j] = 0;
+    }
+
+    for (k = 2; k <= numClasses; k++)
+    {
+        for (j = k; j <= used; j++)
+        {
+            bytes[k][j] = (UINT64)-1;
+            for (i = k - 1; i < j; i++)
+            {
+                cost = bytes[k - 1][i] + sizes[j - 1] * (peaks[j] - peaks[i]);
+                if (cost < bytes[k][j])
+                {
+                    bytes[k][j] = cost;
+                    first[k][j] = i;
+                }
+            }
+        }
+    }
+
+    // Walk the chosen class boundaries back from the largest size
+    for (k = numClasses, j = used; k > 0; k--)
+    {
+        i = first[k][j];
+        classes[k - 1].blockSize = sizes[j - 1];
+        classes[k - 1].maxBlocks = (UINT32)(peaks[j] - peaks[i]);
+        j = i;
+    }
+
+    return numClasses;
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_WriteFile
+//----------------------------------------------------------------------------
+void SMPROF_WriteFile(const CHAR* text, void* context)
+{
+    ASSERT_TRUE(context);
+    fputs(text, (FILE*)context);
+}
+
+//----------------------------------------------------------------------------
+// SMPROF_Report
+//----------------------------------------------------------------------------
+void SMPROF_Report(SMPROF_WriteFunc writeFunc, void* context)
+{
+    CHAR line[128];
+    SMPROF_Bucket buckets[SMPROF_BUCKETS];
+    SMPROF_SizeClass classes[SMPROF_MAX_CLASSES];
+    UINT16 numClasses;
+    UINT16 i;
+
+    ASSERT_TRUE(writeFunc);
+
+    LK_LOCK(_hLock);
+    memcpy(buckets, _buckets, sizeof(buckets));
+    LK_UNLOCK(_hLock);
+
+    writeFunc("SMPROF size histogram (bytes requests peak)\n", context);
+    for (i = 0; i < SMPROF_BUCKETS; i++)
+    {
+        if (!buckets[i].requests)
+            continue;
+
+        if (i == SMPROF_BUCKETS - 1)
+            snprintf(line, sizeof(line), "  >%d %llu %u\n", SMPROF_MAX_SIZE,
+                (unsigned long long)buckets[i].requests, buckets[i].peakLive);
+        else
+            snprintf(line, sizeof(line), "  <=%d %llu %u\n", (int)SMPROF_BUCKET_SIZE(i),
+                (unsigned long long)buckets[i].requests, buckets[i].peakLive);
+        writeFunc(line, context);
+    }
+
+    // The static pool of each class holds the observed peak
+    writeFunc("SMPROF recommended size classes\n", context);
+    numClasses = SMPROF_GetClasses(classes, SMPROF_MAX_CLASSES);
+    for (i = 0; i < numClasses; i++)
+    {
+        snprintf(line, sizeof(line), "  XALLOC_DEFINE_GROW(smDataAllocator%d, %d, %u, %d)\n",
+            (int)classes[i].blockSize, (int)classes[i].blockSize, classes[i].maxBlocks, SMPROF_MAX_SLABS);
+        writeFunc(line, context);
+    }
+}
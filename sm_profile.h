@@ -0,0 +1,72 @@
+// The SMPROF module is an allocation profiler for sizing the SMALLOC pools.
+// Define SMALLOC_PROFILE (see sm_allocator.h) and the SMALLOC_ functions
+// forward to SMPROF instead of the fixed block allocators. Each block is
+// allocated from the heap, so a profiling run never exhausts a pool.
+//
+// SMPROF records a histogram of the requested sizes, in SMPROF_GRANULE byte
+// buckets, and the peak number of concurrently live blocks per bucket.
+// SMPROF_GetClasses() then chooses up to SMPROF_MAX_CLASSES block sizes
+// and counts that hold the observed peaks with the least static memory
+// (i.e. the least internal fragmentation). The block count of a size
+// class is the sum of its bucket peaks, an upper bound on its true peak.
+//
+// Run a representative workload, then call SMPROF_Report() to write the
+// histogram and the recommended XALLOC_DEFINE_GROW table used by the 
+// SMALLOC pools.
+//
+// SMPROF_Report(SMPROF_WriteFile, stdout);
+
+#ifndef _SM_PROFILE_H
+#define _SM_PROFILE_H
+
+#include <stddef.h>
+#include "DataTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Histogram bucket width in bytes
+#define SMPROF_GRANULE          8
+
+// Largest request size with its own bucket. Larger requests share the
+// final bucket and are excluded from the recommendation.
+#define SMPROF_MAX_SIZE         512
+
+// Number of histogram buckets including the final oversize bucket
+#define SMPROF_BUCKETS          ((SMPROF_MAX_SIZE / SMPROF_GRANULE) + 1)
+
+// Maximum number of size classes SMPROF_GetClasses() recommends
+#define SMPROF_MAX_CLASSES      4
+
+// Slabs SMPROF_Report() recommends each size class may grow by beyond the 
+// observed peak, for bursts the profiled workload did not produce
+#define SMPROF_MAX_SLABS        4
+
+// A recommended fixed block allocator
+typedef struct
+{
+    size_t blockSize;       // Client bytes, excluding XALLOC_BLOCK_META_DATA_SIZE
+    UINT32 maxBlocks;
+} SMPROF_SizeClass;
+
+// Called with each line of reported text, including the newline
+typedef void (*SMPROF_WriteFunc)(const CHAR* text, void* context);
+
+// Write function for a FILE* context
+void SMPROF_WriteFile(const CHAR* text, void* context);
+
+void SMPROF_Init(void);
+void SMPROF_Term(void);
+void* SMPROF_Alloc(size_t size);
+void* SMPROF_AllocAligned(size_t size, size_t align);
+void SMPROF_Free(void* ptr);
+void* SMPROF_Realloc(void* ptr, size_t new_size);
+UINT16 SMPROF_GetClasses(SMPROF_SizeClass* classes, UINT16 maxClasses);
+void SMPROF_Report(SMPROF_WriteFunc writeFunc, void* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_PROFILE_H
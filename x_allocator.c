@@ -2,12 +2,37 @@
 #include "fb_allocator.h"
 #include "DataTypes.h"
 #include "Fault.h"
+#include "Atomic.h"
 #include <string.h>
 
 static void* XALLOC_PutAllocatorPtrInBlock(void* block, ALLOC_Allocator* allocator);
 static ALLOC_Allocator* XALLOC_GetAllocatorPtrFromBlock(void* block);
 static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size);
 
+// Client memory alignment provided by an allocator defined using 
+// XALLOC_DEFINE_ALIGNED, or with XALLOC_HEADER_FREE using XALLOC_DEFINE or
+// XALLOC_DEFINE_GROW, or 0 for any other allocator
+#define XALLOC_CLIENT_ALIGNMENT(_allocator_) \
+    ((((_allocator_)->alignment > ALLOC_MEM_ALIGN) && \
+      ((_allocator_)->alignOffset == XALLOC_BLOCK_META_DATA_SIZE)) ? (_allocator_)->alignment : 0)
+
+// An allocator kept for aligned requests only. Without a block header an 
+// aligned allocator is no different from any other, so none is kept.
+#ifndef XALLOC_HEADER_FREE
+    #define XALLOC_ALIGNED_ONLY(_allocator_)    (XALLOC_CLIENT_ALIGNMENT(_allocator_) != 0)
+#else
+    #define XALLOC_ALIGNED_ONLY(_allocator_)    FALSE
+#endif
+
+// Build the size class lookup table on first use if XALLOC_Init() was not 
+// called, so a lookup never silently degrades to the linear search
+#define XALLOC_ENSURE_BUILT(_self_) \
+    do { \
+        if (ATOMIC_Load32(&(_self_)->state) != XALLOC_STATE_BUILT) \
+            XALLOC_Init(_self_); \
+    } while (0)
+
+#ifndef XALLOC_HEADER_FREE
 //----------------------------------------------------------------------------
 // XALLOC_PutAllocatorPtrInBlock
 //----------------------------------------------------------------------------
@@ -63,6 +88,117 @@ static void* XALLOC_GetBlockPtr(void* block)
     // Back up one ALLOC_Allocator* position and return raw memory block pointer
     return --pAllocatorInBlock;
 }
+#else
+// The address range of one allocator's static pool
+typedef struct
+{
+    const char* pStart;
+    const char* pEnd;
+    ALLOC_Allocator* pAllocator;
+} XALLOC_Range;
+
+// Allocator pool ranges sorted by start address
+static XALLOC_Range _ranges[XALLOC_MAX_RANGES];
+static UINT16 _numRanges = 0;
+
+// Growable allocators whose chained slabs lie outside the sorted ranges
+static ALLOC_Allocator* _growable[XALLOC_MAX_RANGES];
+static UINT16 _numGrowable = 0;
+
+//----------------------------------------------------------------------------
+// XALLOC_AddRange
+//----------------------------------------------------------------------------
+static void XALLOC_AddRange(ALLOC_Allocator* allocator)
+{
+    UINT16 i = 0;
+
+    ASSERT_TRUE(allocator);
+
+    // An allocator shared by multiple XAllocData instances is added once
+    for (i=0; i<_numRanges; i++)
+    {
+        if (_ranges[i].pAllocator == allocator)
+            return;
+    }
+
+    ASSERT_TRUE(_numRanges < XALLOC_MAX_RANGES);
+
+    // Insert the range keeping the table sorted by start address
+    for (i=_numRanges; i>0 && _ranges[i-1].pStart > allocator->pPool; i--)
+        _ranges[i] = _ranges[i-1];
+
+    _ranges[i].pStart = allocator->pPool;
+    _ranges[i].pEnd = allocator->pPool + (allocator->maxBlocks * allocator->blockSize);
+    _ranges[i].pAllocator = allocator;
+    _numRanges++;
+
+    if (allocator->maxSlabs)
+    {
+        ASSERT_TRUE(_numGrowable < XALLOC_MAX_RANGES);
+        _growable[_numGrowable++] = allocator;
+    }
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_PutAllocatorPtrInBlock
+//----------------------------------------------------------------------------
+static void* XALLOC_PutAllocatorPtrInBlock(void* block, ALLOC_Allocator* allocator)
+{
+    ASSERT_TRUE(block);
+    ASSERT_TRUE(allocator);
+
+    // No header, the client's memory region is the entire block
+    return block;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_GetAllocatorPtrFromBlock
+//----------------------------------------------------------------------------
+static ALLOC_Allocator* XALLOC_GetAllocatorPtrFromBlock(void* block)
+{
+    UINT16 low = 0;
+    UINT16 high = _numRanges;
+    UINT16 mid = 0;
+    UINT16 i = 0;
+
+    ASSERT_TRUE(block);
+
+    // Binary search for the last range starting at or before the block
+    while (low < high)
+    {
+        mid = (UINT16)((low + high) / 2);
+        if (_ranges[mid].pStart <= (const char*)block)
+            low = (UINT16)(mid + 1);
+        else
+            high = mid;
+    }
+
+    if (low && (const char*)block < _ranges[low-1].pEnd)
+        return _ranges[low-1].pAllocator;
+
+    // Otherwise the block must be within a chained slab
+    for (i=0; i<_numGrowable; i++)
+    {
+        if (ALLOC_OwnsBlock(_growable[i], block))
+            return _growable[i];
+    }
+
+    // Block not allocated by any XALLOC allocator
+    ASSERT();
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_GetBlockPtr
+//----------------------------------------------------------------------------
+static void* XALLOC_GetBlockPtr(void* block)
+{
+    ASSERT_TRUE(block);
+
+    // No header, the block starts at the client's memory region
+    return block;
+}
+#endif // XALLOC_HEADER_FREE
 
 //----------------------------------------------------------------------------
 // XALLOC_GetAllocator
@@ -70,9 +206,16 @@ static void* XALLOC_GetBlockPtr(void* block)
 static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size)
 {
     UINT16 i = 0;
+    size_t granule;
     ALLOC_Allocator* pAllocator = NULL;
 
     ASSERT_TRUE(self);
+    XALLOC_ENSURE_BUILT(self);
+
+    // Look up the size class directly if the size is within the table
+    granule = (size + XALLOC_LOOKUP_GRANULE - 1) / XALLOC_LOOKUP_GRANULE;
+    if (granule < XALLOC_LOOKUP_ENTRIES && self->lookup[granule])
+        return self->allocators[self->lookup[granule] - 1];
 
     // Each block stores additional meta data (i.e. an ALLOC_Allocator pointer). 
     // Add overhead for the additional memory required.
@@ -82,7 +225,8 @@ static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size)
     for (i=0; i<self->maxAllocators; i++)
     {
         // Can the allocator instance handle the requested size?
-        if (self->allocators[i] && self->allocators[i]->blockSize >= size)
+        if (self->allocators[i] && ALLOC_USABLE_SIZE(self->allocators[i]) >= size &&
+            !XALLOC_ALIGNED_ONLY(self->allocators[i]))
         {
             // Return allocator instance to handle memory request
             pAllocator = self->allocators[i];
@@ -93,25 +237,135 @@ static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size)
     return pAllocator;
 } 
 
+//----------------------------------------------------------------------------
+// XALLOC_Register
+//----------------------------------------------------------------------------
+void XALLOC_Register(ALLOC_Allocator* pAllocator)
+{
+    ASSERT_TRUE(pAllocator);
+
+    ALLOC_Register(pAllocator);
+#ifdef XALLOC_HEADER_FREE
+    XALLOC_AddRange(pAllocator);
+#endif
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_Init
+//----------------------------------------------------------------------------
+void XALLOC_Init(XAllocData* self)
+{
+    UINT16 i = 0;
+    size_t granule;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->maxAllocators < 0xFF);
+
+    // Only one thread builds the table, any other waits until it is built
+    if (!ATOMIC_Cas32(&self->state, XALLOC_STATE_NONE, XALLOC_STATE_BUILDING))
+    {
+        while (ATOMIC_Load32(&self->state) != XALLOC_STATE_BUILT)
+            ;
+        return;
+    }
+
+    // Register each allocator instance with the fb_allocator module
+    for (i=0; i<self->maxAllocators; i++)
+    {
+        if (self->allocators[i])
+            XALLOC_Register(self->allocators[i]);
+    }
+
+    // Build the size class lookup table. Each granule maps to the smallest 
+    // allocator able to hold the largest size within that granule.
+    for (granule=0; granule<XALLOC_LOOKUP_ENTRIES; granule++)
+    {
+        self->lookup[granule] = 0;
+        for (i=0; i<self->maxAllocators; i++)
+        {
+            if (self->allocators[i] && ALLOC_USABLE_SIZE(self->allocators[i]) >= 
+                (granule * XALLOC_LOOKUP_GRANULE) + XALLOC_BLOCK_META_DATA_SIZE &&
+                !XALLOC_ALIGNED_ONLY(self->allocators[i]))
+            {
+                self->lookup[granule] = (BYTE)(i + 1);
+                break;
+            }
+        }
+    }
+
+    ATOMIC_Exchange32(&self->state, XALLOC_STATE_BUILT);
+}
+
 //----------------------------------------------------------------------------
 // XALLOC_Alloc
 //----------------------------------------------------------------------------
 void* XALLOC_Alloc(XAllocData* self, size_t size)
 {
     ALLOC_Allocator* pAllocator;
-    void* pBlockMemory = NULL;
-    void* pClientMemory = NULL;
 
     ASSERT_TRUE(self);
 
     // Get an allocator instance to handle the memory request
     pAllocator = XALLOC_GetAllocator(self, size);
 
+    return XALLOC_AllocFrom(pAllocator, size);
+} 
+
+//----------------------------------------------------------------------------
+// XALLOC_AllocAligned
+//----------------------------------------------------------------------------
+void* XALLOC_AllocAligned(XAllocData* self, size_t size, size_t align)
+{
+    UINT16 i = 0;
+    ALLOC_Allocator* pAllocator = NULL;
+
+    ASSERT_TRUE(self);
+    XALLOC_ENSURE_BUILT(self);
+
+    // Find the smallest aligned allocator meeting the alignment and size 
+    for (i=0; i<self->maxAllocators; i++)
+    {
+        if (self->allocators[i] && 
+            XALLOC_CLIENT_ALIGNMENT(self->allocators[i]) >= align &&
+            ALLOC_USABLE_SIZE(self->allocators[i]) >= size + XALLOC_BLOCK_META_DATA_SIZE)
+        {
+            pAllocator = self->allocators[i];
+            break;
+        }
+    }
+
+    return XALLOC_AllocFrom(pAllocator, size);
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_AllocFrom
+//----------------------------------------------------------------------------
+void* XALLOC_AllocFrom(ALLOC_Allocator* pAllocator, size_t size)
+{
+    void* pClientMemory = XALLOC_TryAllocFrom(pAllocator, size);
+
+#ifndef ALLOC_RETURN_NULL
+    // Out of fixed block memory
+    if (pAllocator && !pClientMemory)
+        ASSERT();
+#endif
+
+    return pClientMemory;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_TryAllocFrom
+//----------------------------------------------------------------------------
+void* XALLOC_TryAllocFrom(ALLOC_Allocator* pAllocator, size_t size)
+{
+    void* pBlockMemory = NULL;
+    void* pClientMemory = NULL;
+
     // An allocator found to handle memory request?
     if (pAllocator)
     {
         // Get a fixed memory block from the allocator instance
-        pBlockMemory = ALLOC_Alloc(pAllocator, size + XALLOC_BLOCK_META_DATA_SIZE);
+        pBlockMemory = ALLOC_TryAlloc(pAllocator, size + XALLOC_BLOCK_META_DATA_SIZE);
         if (pBlockMemory)
         {
             // Set the block ALLOC_Allocator* ptr within the raw memory block region
@@ -125,7 +379,7 @@ void* XALLOC_Alloc(XAllocData* self, size_t size)
     }
 
     return pClientMemory;
-} 
+}
 
 //----------------------------------------------------------------------------
 // XALLOC_Free
@@ -150,6 +404,72 @@ void XALLOC_Free(void* ptr)
     }
 } 
 
+//----------------------------------------------------------------------------
+// XALLOC_AllocBulk
+//----------------------------------------------------------------------------
+UINT32 XALLOC_AllocBulk(XAllocData* self, size_t size, void** ptrs, UINT32 count)
+{
+    ALLOC_Allocator* pAllocator = NULL;
+    UINT32 allocated = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(ptrs || !count);
+
+    // Get an allocator instance to handle the memory request
+    pAllocator = XALLOC_GetAllocator(self, size);
+    if (!pAllocator)
+    {
+        // Too large a memory block requested
+        ASSERT();
+        return 0;
+    }
+
+    // Get all fixed memory blocks from the allocator instance at once
+    allocated = ALLOC_AllocBulk(pAllocator, size + XALLOC_BLOCK_META_DATA_SIZE, ptrs, count);
+
+    // Set the block ALLOC_Allocator* ptr within each raw memory block region
+    for (i=0; i<allocated; i++)
+        ptrs[i] = XALLOC_PutAllocatorPtrInBlock(ptrs[i], pAllocator);
+
+    return allocated;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_FreeBulk
+//----------------------------------------------------------------------------
+void XALLOC_FreeBulk(void** ptrs, UINT32 count)
+{
+    void* blocks[XALLOC_BULK_BATCH];
+    ALLOC_Allocator* pAllocator = NULL;
+    ALLOC_Allocator* pBlockAllocator = NULL;
+    UINT32 batched = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(ptrs || !count);
+
+    // Gather runs of blocks owned by the same allocator and free each run 
+    // with one call into the allocator
+    for (i=0; i<count; i++)
+    {
+        if (!ptrs[i])
+            continue;
+
+        pBlockAllocator = XALLOC_GetAllocatorPtrFromBlock(ptrs[i]);
+        if (batched && (pBlockAllocator != pAllocator || batched == XALLOC_BULK_BATCH))
+        {
+            ALLOC_FreeBulk(pAllocator, blocks, batched);
+            batched = 0;
+        }
+
+        pAllocator = pBlockAllocator;
+        blocks[batched++] = XALLOC_GetBlockPtr(ptrs[i]);
+    }
+
+    if (batched)
+        ALLOC_FreeBulk(pAllocator, blocks, batched);
+}
+
 //----------------------------------------------------------------------------
 // XALLOC_Realloc
 //----------------------------------------------------------------------------
@@ -167,14 +487,23 @@ void* XALLOC_Realloc(XAllocData* self, void *ptr, size_t new_size)
         XALLOC_Free(ptr);
     else
     {
+        // Get the original allocator instance from the old memory block
+        pOldAllocator = XALLOC_GetAllocatorPtrFromBlock(ptr);
+        oldSize = ALLOC_USABLE_SIZE(pOldAllocator) - XALLOC_BLOCK_META_DATA_SIZE;
+
+        // Keep the existing block if the size class is unchanged. An aligned 
+        // block is kept whenever the new size fits to preserve its alignment.
+        if (new_size <= oldSize && 
+            (XALLOC_GetAllocator(self, new_size) == pOldAllocator || 
+             XALLOC_CLIENT_ALIGNMENT(pOldAllocator)))
+        {
+            return ptr;
+        }
+
         // Create a new memory block
         pNewMem = XALLOC_Alloc(self, new_size);
         if (pNewMem != 0)
         {
-            // Get the original allocator instance from the old memory block
-            pOldAllocator = XALLOC_GetAllocatorPtrFromBlock(ptr);
-            oldSize = pOldAllocator->blockSize - XALLOC_BLOCK_META_DATA_SIZE;
-
             // Copy the bytes from the old memory block into the new (as much as will fit)
             memcpy(pNewMem, ptr, (oldSize < new_size) ? oldSize : new_size);
 
@@ -210,7 +539,25 @@ void* XALLOC_Calloc(XAllocData* self, size_t num, size_t size)
     }
 
     return pMem;
-} 
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_GetStats
+//----------------------------------------------------------------------------
+UINT16 XALLOC_GetStats(XAllocData* self, ALLOC_Stats* pStats, UINT16 maxStats)
+{
+    UINT16 i;
+    UINT16 count = 0;
 
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(pStats || !maxStats);
 
+    // Snapshot the statistics of each allocator instance
+    for (i=0; i<self->maxAllocators && count<maxStats; i++)
+    {
+        if (self->allocators[i])
+            ALLOC_GetAllocatorStats(self->allocators[i], &pStats[count++]);
+    }
 
+    return count;
+}
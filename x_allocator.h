@@ -11,14 +11,10 @@
 // #define MAX_128_BLOCKS   5
 // #define MAX_512_BLOCKS   2
 //
-// #define BLOCK_32_SIZE           32 + XALLOC_BLOCK_META_DATA_SIZE
-// #define BLOCK_128_SIZE          128 + XALLOC_BLOCK_META_DATA_SIZE
-// #define BLOCK_512_SIZE          512 + XALLOC_BLOCK_META_DATA_SIZE
-//
 // // Define each fb_allocator instance
-// ALLOC_DEFINE(myAllocator32, BLOCK_32_SIZE, MAX_32_BLOCKS)
-// ALLOC_DEFINE(myAllocator128, BLOCK_128_SIZE, MAX_128_BLOCKS)
-// ALLOC_DEFINE(myAllocator512, BLOCK_512_SIZE, MAX_512_BLOCKS)
+// XALLOC_DEFINE(myAllocator32, 32, MAX_32_BLOCKS)
+// XALLOC_DEFINE(myAllocator128, 128, MAX_128_BLOCKS)
+// XALLOC_DEFINE(myAllocator512, 512, MAX_512_BLOCKS)
 //
 // // An array of allocators sorted by smallest to largest block 
 // static ALLOC_Allocator* allocators[] = {
@@ -29,16 +25,24 @@
 //
 // #define MAX_ALLOCATORS   (sizeof(allocators) / sizeof(allocators[0]))
 //
-// static XAllocData self = { allocators, MAX_ALLOCATORS };
+// static XAllocData self = { allocators, MAX_ALLOCATORS, { 0 }, XALLOC_STATE_NONE };
 //
 // // Thin allocator wrapper function implementations call XALLOC
+// void MYALLOC_Init(void) { XALLOC_Init(&self); }
 // void* MYALLOC_Alloc(size_t size) { return XALLOC_Alloc(&self, size); }
 // void MYALLOC_Free(void* ptr) { XALLOC_Free(ptr); }
 // void* MYALLOC_Realloc(void *ptr, size_t new_size) { return XALLOC_Realloc(&self, ptr, new_size); }
 // void* MYALLOC_Calloc(size_t num, size_t size) { return XALLOC_Calloc(&self, num, size); }
 //
+// An allocator outside of the allocators array, such as a pool dedicated 
+// to one data type, is registered using XALLOC_Register() and allocated 
+// from using XALLOC_AllocFrom(). XALLOC_TryAllocFrom() returns NULL when the
+// allocator is out of blocks, so the caller may fall back to another. 
+// XALLOC_Free() frees its blocks as usual.
+//
 // Expose the allocator functions in my_allocator.h:
 //
+// void MYALLOC_Init(void);
 // void* MYALLOC_Alloc(size_t size);
 // void MYALLOC_Free(void* ptr);
 // void* MYALLOC_Realloc(void *ptr, size_t new_size);
@@ -54,8 +58,66 @@
 extern "C" {
 #endif
 
+// Define XALLOC_HEADER_FREE to omit the ALLOC_Allocator* stored within each 
+// block. XALLOC_Free() instead finds the owning allocator from the block 
+// address using a sorted table of the allocator pool ranges, built by 
+// XALLOC_Init() and XALLOC_Register(), so every allocator must be registered
+// before its blocks are freed. Allocators defined using XALLOC_DEFINE or 
+// XALLOC_DEFINE_GROW then align each block on its power of two size, so 
+// every such allocator also serves XALLOC_AllocAligned() requests.
+// #define XALLOC_HEADER_FREE
+
 // Overhead bytes added to each XALLOC memory block
-#define XALLOC_BLOCK_META_DATA_SIZE  sizeof(ALLOC_Allocator*)
+#ifndef XALLOC_HEADER_FREE
+    #define XALLOC_BLOCK_META_DATA_SIZE  sizeof(ALLOC_Allocator*)
+#else
+    #define XALLOC_BLOCK_META_DATA_SIZE  0
+
+    // Maximum number of allocators across all XAllocData instances
+    #define XALLOC_MAX_RANGES   32
+#endif
+
+// Requested sizes are rounded up to a granule to index the size class lookup
+// table. Sizes above the table range fall back to a linear allocator search.
+#define XALLOC_LOOKUP_GRANULE   8
+#define XALLOC_LOOKUP_ENTRIES   ((512 / XALLOC_LOOKUP_GRANULE) + 1)
+
+// Maximum blocks XALLOC_FreeBulk() returns to an allocator in one batch
+#define XALLOC_BULK_BATCH       32
+
+// Defines an fb_allocator holding _objects_ blocks of _size_ client bytes 
+// plus the block header, for use within an XAllocData allocators array. A
+// growable allocator chains up to _maxSlabs_ more slabs of _objects_ blocks.
+// With XALLOC_HEADER_FREE _size_ must be a literal power of two, and the 
+// pool and slabs are aligned on _size_ so each block starts on a _size_ 
+// byte boundary.
+// e.g. XALLOC_DEFINE(myAllocator32, 32, 10)
+// e.g. XALLOC_DEFINE_GROW(myAllocator32, 32, 10, 4)
+#ifndef XALLOC_HEADER_FREE
+    #define XALLOC_DEFINE(_name_, _size_, _objects_) \
+        ALLOC_DEFINE(_name_, (_size_) + XALLOC_BLOCK_META_DATA_SIZE, _objects_)
+    #define XALLOC_DEFINE_GROW(_name_, _size_, _objects_, _maxSlabs_) \
+        ALLOC_DEFINE_GROW(_name_, (_size_) + XALLOC_BLOCK_META_DATA_SIZE, _objects_, _maxSlabs_)
+#else
+    #define XALLOC_DEFINE(_name_, _size_, _objects_) \
+        ALLOC_DEFINE_ALIGNED(_name_, _size_, _objects_, _size_)
+    #define XALLOC_DEFINE_GROW(_name_, _size_, _objects_, _maxSlabs_) \
+        ALLOC_DEFINE_GROW_ALIGNED(_name_, _size_, _objects_, _maxSlabs_, _size_)
+#endif
+
+// Defines an fb_allocator whose client memory is aligned on an _align_ byte
+// boundary (e.g. 16, 32 or 64) for use with XALLOC_AllocAligned(). The block
+// header sits in the bytes before the aligned client region. The header and
+// the client region are each rounded up to a multiple of _align_, so the 
+// client region never shares a cache line with another block, e.g. a 64 byte
+// client region aligned on 64 uses a 128 byte block. Only the allocator 
+// instance _name_##Obj is defined, for use within an XAllocData allocators 
+// array. Aligned allocators within an XAllocData are only used for aligned
+// requests, unless XALLOC_HEADER_FREE is defined.
+// e.g. XALLOC_DEFINE_ALIGNED(myAllocatorAligned64, 64, 10, 64)
+#define XALLOC_DEFINE_ALIGNED(_name_, _size_, _objects_, _align_) \
+    _ALLOC_DEFINE_ALIGNED(_name_, (_size_) + XALLOC_BLOCK_META_DATA_SIZE, _objects_, \
+        _align_, XALLOC_BLOCK_META_DATA_SIZE)
 
 typedef struct
 {
@@ -64,12 +126,33 @@ typedef struct
 
     // Number of allocator instances stored within the allocators array
     const UINT16 maxAllocators;
+
+    // Size class lookup table built by XALLOC_Init(). Each entry is the 
+    // allocators array index + 1 for that size granule, or 0 if none.
+    BYTE lookup[XALLOC_LOOKUP_ENTRIES];
+
+    // Lookup table state, an XALLOC_STATE_ value. The first allocation 
+    // builds the table if XALLOC_Init() was not called.
+    volatile UINT32 state;
 } XAllocData;
 
+// XAllocData::state values
+#define XALLOC_STATE_NONE       0
+#define XALLOC_STATE_BUILDING   1
+#define XALLOC_STATE_BUILT      2
+
+void XALLOC_Init(XAllocData* self);
+void XALLOC_Register(ALLOC_Allocator* pAllocator);
+void* XALLOC_AllocFrom(ALLOC_Allocator* pAllocator, size_t size);
+void* XALLOC_TryAllocFrom(ALLOC_Allocator* pAllocator, size_t size);
 void* XALLOC_Alloc(XAllocData* self, size_t size);
+void* XALLOC_AllocAligned(XAllocData* self, size_t size, size_t align);
 void XALLOC_Free(void* ptr);
+UINT32 XALLOC_AllocBulk(XAllocData* self, size_t size, void** ptrs, UINT32 count);
+void XALLOC_FreeBulk(void** ptrs, UINT32 count);
 void* XALLOC_Realloc(XAllocData* self, void *ptr, size_t new_size);
 void* XALLOC_Calloc(XAllocData* self, size_t num, size_t size);
+UINT16 XALLOC_GetStats(XAllocData* self, ALLOC_Stats* pStats, UINT16 maxStats);
 
 #ifdef __cplusplus
 }